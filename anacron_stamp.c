@@ -0,0 +1,248 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef STATE_DIR
+#define STATE_DIR "/var/lib/systemd-cron"
+#endif
+#define STAMPS_FILE STATE_DIR "/anacron.stamps"
+#define STAMPS_TMP STAMPS_FILE ".tmp"
+
+// All anacrontab jobs share one small file: a header followed by an
+// open-addressing hash table of fixed size records keyed by job identifier.
+// A lookup is usually a single pread(), whatever the number of jobs.
+#define MAGIC "ANACRON1"
+#define INITIAL_CAPACITY 256
+
+struct header {
+        char magic[8];
+        uint32_t capacity;
+        uint32_t count;
+};
+
+struct record {
+        char job[56];
+        int64_t day;
+};
+
+static uint32_t hash(const char *job) {
+        // FNV-1a
+        uint32_t h = 2166136261u;
+        for (; *job; job++) {
+                h ^= (unsigned char)*job;
+                h *= 16777619u;
+        }
+        return h;
+}
+
+static off_t slot_offset(uint32_t slot) {
+        return sizeof(struct header) + (off_t)slot * sizeof(struct record);
+}
+
+// local calendar day, like anacron: a 7 days job started late
+// on monday may run again early on the next monday
+static int64_t today(void) {
+        time_t now = time(NULL);
+        struct tm tm;
+        localtime_r(&now, &tm);
+        // fake clock for testing
+        const char *fake = getenv("SYSTEMD_CRON_DATE");
+        if (fake && sscanf(fake, "%d-%d-%d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday) == 3) {
+                tm.tm_year -= 1900;
+                tm.tm_mon -= 1;
+        }
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+        tm.tm_isdst = 0;
+        return timegm(&tm) / 86400;
+}
+
+static int init_table(int fd, struct header *h, uint32_t capacity) {
+        memcpy(h->magic, MAGIC, sizeof(h->magic));
+        h->capacity = capacity;
+        h->count = 0;
+        if (ftruncate(fd, 0) || ftruncate(fd, slot_offset(capacity)))
+                return -1;
+        if (pwrite(fd, h, sizeof(*h), 0) != sizeof(*h))
+                return -1;
+        return 0;
+}
+
+// returns the slot holding job, or the free slot where it belongs
+static int64_t find_slot(int fd, const struct header *h, const char *job, struct record *r) {
+        uint32_t slot = hash(job) % h->capacity;
+        for (uint32_t i = 0; i < h->capacity; i++) {
+                if (pread(fd, r, sizeof(*r), slot_offset(slot)) != sizeof(*r))
+                        return -1;
+                if (r->job[0] == '\0' || !strncmp(r->job, job, sizeof(r->job)))
+                        return slot;
+                slot = (slot + 1) % h->capacity;
+        }
+        return -1;
+}
+
+// the bigger table is built aside and renamed over the old one, so that
+// a crash while growing loses no stamp; on success *fd is the new file,
+// still locked (the lock on the old one keeps other writers out meanwhile)
+static int grow_table(int *fd, struct header *h) {
+        struct record *old = calloc(h->capacity, sizeof(struct record));
+        if (!old)
+                return -1;
+        if (pread(*fd, old, h->capacity * sizeof(struct record), slot_offset(0)) !=
+            (ssize_t)(h->capacity * sizeof(struct record))) {
+                free(old);
+                return -1;
+        }
+
+        int tmp = open(STAMPS_TMP, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (tmp < 0 || flock(tmp, LOCK_EX)) {
+                if (tmp >= 0)
+                        close(tmp);
+                free(old);
+                return -1;
+        }
+
+        struct header grown;
+        struct record r;
+        int ok = !init_table(tmp, &grown, h->capacity * 2);
+        for (uint32_t i = 0; ok && i < h->capacity; i++) {
+                if (old[i].job[0] == '\0')
+                        continue;
+                int64_t slot = find_slot(tmp, &grown, old[i].job, &r);
+                ok = slot >= 0 && pwrite(tmp, &old[i], sizeof(r), slot_offset(slot)) == sizeof(r);
+                grown.count++;
+        }
+        free(old);
+        ok = ok && pwrite(tmp, &grown, sizeof(grown), 0) == sizeof(grown) &&
+             !fsync(tmp) && !rename(STAMPS_TMP, STAMPS_FILE);
+        if (!ok) {
+                unlink(STAMPS_TMP);
+                close(tmp);
+                return -1;
+        }
+        close(*fd);
+        *fd = tmp;
+        *h = grown;
+        return 0;
+}
+
+static int open_table(struct header *h, int flags) {
+        int fd;
+        for (;;) {
+                fd = open(STAMPS_FILE, flags, 0644);
+                if (fd < 0)
+                        return -1;
+                if (flock(fd, (flags & O_RDWR) ? LOCK_EX : LOCK_SH)) {
+                        close(fd);
+                        return -1;
+                }
+                // the table may have been grown, and replaced, while we waited
+                struct stat locked, current;
+                if (!fstat(fd, &locked) && !stat(STAMPS_FILE, &current) &&
+                    locked.st_ino == current.st_ino && locked.st_dev == current.st_dev)
+                        break;
+                close(fd);
+        }
+        if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) ||
+            memcmp(h->magic, MAGIC, sizeof(h->magic)) || h->capacity == 0) {
+                if (!(flags & O_RDWR) || init_table(fd, h, INITIAL_CAPACITY)) {
+                        close(fd);
+                        errno = EINVAL;
+                        return -1;
+                }
+        }
+        return fd;
+}
+
+static int list(void) {
+        struct header h;
+        struct record r;
+        int fd = open_table(&h, O_RDONLY);
+        if (fd < 0) {
+                if (errno == ENOENT)
+                        return 0;
+                perror(STAMPS_FILE);
+                return 1;
+        }
+        for (uint32_t slot = 0; slot < h.capacity; slot++) {
+                if (pread(fd, &r, sizeof(r), slot_offset(slot)) != sizeof(r))
+                        break;
+                if (r.job[0] == '\0')
+                        continue;
+                time_t t = r.day * 86400;
+                struct tm tm;
+                char date[11];
+                gmtime_r(&t, &tm);
+                strftime(date, sizeof(date), "%Y-%m-%d", &tm);
+                printf("%.*s %s\n", (int)sizeof(r.job), r.job, date);
+        }
+        close(fd);
+        return 0;
+}
+
+int main(int argc, char *argv[]) {
+        int days, remainder;
+
+        if (argc == 2 && !strcmp(argv[1], "-l"))
+                return list();
+
+        if (argc != 3 || !argv[1][0] || strlen(argv[1]) >= sizeof(((struct record *)0)->job) ||
+            sscanf(argv[2], "%d %n", &days, &remainder) != 1 || remainder != strlen(argv[2]) || days < 1) {
+                fprintf(stderr, "Usage: anacron_stamp <job-identifier> <days>\n"
+                                "       anacron_stamp -l\n");
+                exit(2);
+        }
+
+        mkdir(STATE_DIR, 0755);
+
+        struct header h;
+        struct record r;
+        int fd = open_table(&h, O_RDWR | O_CREAT);
+        if (fd < 0) {
+                // never block a job because of the bookkeeping
+                perror(STAMPS_FILE);
+                return 0;
+        }
+
+        int64_t day = today();
+        int64_t last = -1;
+        int64_t slot = find_slot(fd, &h, argv[1], &r);
+        if (slot >= 0 && r.job[0] != '\0')
+                last = r.day;
+        if (last >= 0 && day - last < days && day >= last) {
+                close(fd);
+                // ExecCondition=: skip this run, but don't fail the unit
+                return 1;
+        }
+
+        if (slot >= 0 && r.job[0] == '\0' && (h.count + 1) * 2 > h.capacity) {
+                if (grow_table(&fd, &h)) {
+                        perror(STAMPS_FILE);
+                        close(fd);
+                        return 0;
+                }
+                slot = find_slot(fd, &h, argv[1], &r);
+        }
+
+        if (slot >= 0) {
+                int is_new = r.job[0] == '\0';
+                memset(&r, 0, sizeof(r));
+                strncpy(r.job, argv[1], sizeof(r.job) - 1);
+                r.day = day;
+                if (pwrite(fd, &r, sizeof(r), slot_offset(slot)) != sizeof(r))
+                        perror(STAMPS_FILE);
+                else if (is_new) {
+                        h.count++;
+                        pwrite(fd, &h, sizeof(h), 0);
+                }
+        }
+        close(fd);
+        return 0;
+}
@@ -0,0 +1,120 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * batch(1) semantics for BATCH=true jobs: hold the start until the load
+ * average and the pressure stall information are low enough, or until
+ * the maximum wait is over; then the job runs anyway.
+ */
+
+#define FIRST_BACKOFF 5
+#define MAX_BACKOFF 300
+
+static const char *proc = "/proc";
+
+static void usage(void) {
+    fprintf(stderr, "Usage: batch_gate [-l max_load] [-p max_psi] [-w max_wait_minutes]\n");
+    exit(1);
+}
+
+static double loadavg(void) {
+    char *name;
+    double load = 0;
+    asprintf(&name, "%s/loadavg", proc);
+    FILE *fp = fopen(name, "r");
+    free(name);
+    if (fp) {
+        fscanf(fp, "%lf", &load);
+        fclose(fp);
+    }
+    return load;
+}
+
+/* "some avg10" of one resource, -1 without PSI support */
+static double pressure(const char *resource) {
+    char *name;
+    double avg10 = -1;
+    asprintf(&name, "%s/pressure/%s", proc, resource);
+    FILE *fp = fopen(name, "r");
+    free(name);
+    if (fp) {
+        if (fscanf(fp, "some avg10=%lf", &avg10) != 1)
+            avg10 = -1;
+        fclose(fp);
+    }
+    return avg10;
+}
+
+static double max_pressure(void) {
+    const char *resources[] = {"cpu", "io", "memory"};
+    double worst = -1;
+    for (int i = 0; i < 3; i++) {
+        double p = pressure(resources[i]);
+        if (p > worst)
+            worst = p;
+    }
+    return worst;
+}
+
+int main(int argc, char *argv[]) {
+    double max_load = -1, max_psi = -1;
+    int max_wait = 60;
+    int c;
+
+    while ((c = getopt(argc, argv, "l:p:w:")) != -1) {
+        switch (c) {
+            case 'l':
+                max_load = atof(optarg);
+                break;
+            case 'p':
+                max_psi = atof(optarg);
+                break;
+            case 'w':
+                max_wait = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc || max_wait < 0)
+        usage();
+
+    // fake /proc for testing
+    const char *fake = getenv("SYSTEMD_CRON_PROC");
+    if (fake)
+        proc = fake;
+
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int backoff = FIRST_BACKOFF;
+    double load, psi;
+
+    for (;;) {
+        load = loadavg();
+        psi = max_pressure();
+        bool busy = (max_load >= 0 && load > max_load) ||
+                    (max_psi >= 0 && psi > max_psi);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long waited = now.tv_sec - start.tv_sec;
+
+        if (!busy) {
+            if (waited)
+                printf("gated for %ld seconds (load %.2f, pressure %.2f%%)\n", waited, load, psi);
+            return 0;
+        }
+        if (waited >= max_wait * 60L) {
+            printf("<4>starting after the maximum wait of %d minutes (load %.2f, pressure %.2f%%)\n",
+                   max_wait, load, psi);
+            return 0;
+        }
+
+        long remaining = max_wait * 60L - waited;
+        sleep(backoff < remaining ? backoff : remaining);
+        backoff = backoff * 2 < MAX_BACKOFF ? backoff * 2 : MAX_BACKOFF;
+    }
+}
@@ -0,0 +1,205 @@
+/*
+ * ns/line of each stage of the crontab parser, and of the whole of
+ * parse_crontab() in dry-run mode, over the crontabs given:
+ * files named anacrontab* are read as anacrontabs, user* as user
+ * crontabs, the others as system crontabs with a user field.
+ */
+
+#define main generator_main
+#include "../systemd-crontab-generator.c"
+#undef main
+
+#define ROUNDS_NS 200000000 // each stage runs for about 0.2s
+
+typedef struct job_fields
+{
+    char *m, *h, *dom, *mon, *dow;
+} job_fields;
+
+static char **lines = NULL;
+static size_t line_count = 0;
+static job_fields *jobs = NULL;
+static size_t job_count = 0;
+static char **keys = NULL;
+static char **values = NULL;
+static size_t assignment_count = 0;
+
+static char **files = NULL;
+static size_t file_count = 0;
+static size_t file_lines = 0;
+
+static volatile size_t sink;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void load(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        char *p = strchr(line, '\n');
+        if (p)
+            p[0] = '\0';
+        lines = realloc(lines, (line_count + 1) * sizeof(char *));
+        lines[line_count++] = strdup(line);
+        file_lines++;
+
+        compress_blanks(line);
+        if (line[0] == '#' || line[0] == '@' || !line[0])
+            continue;
+        char *equal = strchr(line, '=');
+        char *blank = strchr(line, ' ');
+        if (equal && (!blank || equal < blank)) {
+            equal[0] = '\0';
+            keys = realloc(keys, (assignment_count + 1) * sizeof(char *));
+            values = realloc(values, (assignment_count + 1) * sizeof(char *));
+            keys[assignment_count] = strdup(line);
+            values[assignment_count++] = strdup(equal + 1);
+            continue;
+        }
+        // as long as parse_crontab() takes them
+        char m[1024], h[1024], dom[1024], mon[1024], dow[1024];
+        if (sscanf(line, "%1023s %1023s %1023s %1023s %1023s", m, h, dom, mon, dow) == 5) {
+            jobs = realloc(jobs, (job_count + 1) * sizeof(job_fields));
+            jobs[job_count++] = (job_fields){strdup(m), strdup(h), strdup(dom), strdup(mon), strdup(dow)};
+        }
+    }
+    fclose(fp);
+    files = realloc(files, (file_count + 1) * sizeof(char *));
+    files[file_count++] = strdup(path);
+}
+
+static void report(const char *stage, size_t calls, uint64_t ns) {
+    printf("%-16s %10zu calls %10.1f ns/line\n", stage, calls, calls ? (double)ns / calls : 0);
+}
+
+static void bench_compress_blanks(void) {
+    char buffer[1024];
+    size_t calls = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t i = 0; i < line_count; i++) {
+            strcpy(buffer, lines[i]);
+            compress_blanks(buffer);
+            sink += buffer[0];
+        }
+        calls += line_count;
+    } while ((elapsed = now_ns() - start) < ROUNDS_NS);
+    report("compress_blanks", calls, elapsed);
+}
+
+static void bench_parse_dow(void) {
+    char dows[3 * 1024];
+    size_t calls = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t i = 0; i < job_count; i++) {
+            parse_dow(jobs[i].dow, dows, sizeof(dows));
+            sink += dows[0];
+        }
+        calls += job_count;
+    } while ((elapsed = now_ns() - start) < ROUNDS_NS);
+    report("parse_dow", calls, elapsed);
+}
+
+static void bench_expand_range(void) {
+    size_t calls = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t i = 0; i < job_count; i++) {
+            char *fields[] = {
+                expand_range(jobs[i].mon, month_names, 1),
+                expand_range(jobs[i].dom, NULL, 1),
+                expand_range(jobs[i].h, NULL, 0),
+                expand_range(jobs[i].m, NULL, 0),
+            };
+            for (int k = 0; k < 4; k++) {
+                sink += fields[k][0];
+                free(fields[k]);
+            }
+        }
+        calls += job_count;
+    } while ((elapsed = now_ns() - start) < ROUNDS_NS);
+    report("expand_range", calls, elapsed);
+}
+
+static void bench_str_to_bool(void) {
+    size_t calls = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t i = 0; i < assignment_count; i++)
+            sink += str_to_bool(values[i]);
+        calls += assignment_count;
+    } while ((elapsed = now_ns() - start) < ROUNDS_NS);
+    report("str_to_bool", calls, elapsed);
+}
+
+/* the environment of a crontab is rebuilt at each read */
+static void bench_text_dict_set(void) {
+    size_t calls = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        env *head = NULL;
+        for (size_t i = 0; i < assignment_count; i++)
+            head = text_dict_set(head, keys[i], values[i]);
+        text_dict_free(head);
+        calls += assignment_count;
+    } while ((elapsed = now_ns() - start) < ROUNDS_NS);
+    report("text_dict_set", calls, elapsed);
+}
+
+static void bench_parse_crontab(void) {
+    size_t calls = 0;
+    uint64_t start = now_ns(), elapsed;
+    do {
+        for (size_t i = 0; i < file_count; i++) {
+            char *copy = strdup(files[i]);
+            char *slash = strrchr(copy, '/');
+            const char *name = slash ? slash + 1 : copy;
+            const char *dir = slash ? (slash[0] = '\0', copy[0] ? copy : "/") : ".";
+            if (!strncmp(name, "anacrontab", 10))
+                parse_crontab(dir, name, "root", true);
+            else if (!strncmp(name, "user", 4))
+                parse_crontab(dir, name, "root", false);
+            else
+                parse_crontab(dir, name, NULL, false);
+            free(copy);
+        }
+        write_catchup_dropins();
+        index_reset();
+        calls += file_lines;
+    } while ((elapsed = now_ns() - start) < ROUNDS_NS);
+    report("parse_crontab", calls, elapsed);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: microbench <crontab>...\n");
+        exit(1);
+    }
+    for (int i = 1; i < argc; i++)
+        load(argv[i]);
+    printf("%zu files, %zu lines, %zu jobs, %zu variables\n",
+           file_count, line_count, job_count, assignment_count);
+
+    dry_run = true;
+    debug = true;
+
+    bench_compress_blanks();
+    bench_parse_dow();
+    bench_expand_range();
+    bench_str_to_bool();
+    bench_text_dict_set();
+    bench_parse_crontab();
+
+    if (errors)
+        fprintf(stderr, "%d errors in the corpus\n", errors);
+    return 0;
+}
@@ -1,3 +1,4 @@
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,17 +6,31 @@
 
 int main(int argc, char *argv[]) {
     int delay, remainder;
-    if (argc != 2 || !sscanf(argv[1],"%d %n", &delay, &remainder) || remainder != strlen(argv[1])) {
-        fprintf(stderr, "Usage: boot-delay <minutes>\n");
+    bool dry_run = argc == 3 && !strcmp(argv[1], "-n");
+    const char *arg = argv[argc - 1];
+    if ((argc != 2 && !dry_run) || sscanf(arg, "%d%n", &delay, &remainder) != 1 ||
+        (remainder != strlen(arg) && strcmp(arg + remainder, "s") && strcmp(arg + remainder, "m"))) {
+        fprintf(stderr, "Usage: boot-delay [-n] <seconds>[s]|<minutes>m\n");
         exit(1);
     }
+    if (!strcmp(arg + remainder, "m"))
+        delay *= 60;
 
     int uptime;
-    FILE *fp;
-    fp = fopen("/proc/uptime", "r");
-    fscanf(fp, "%d.", &uptime);
-    fclose(fp);
+    // fake clock for testing
+    const char *fake = getenv("SYSTEMD_CRON_UPTIME");
+    if (fake)
+        uptime = atoi(fake);
+    else {
+        FILE *fp;
+        fp = fopen("/proc/uptime", "r");
+        fscanf(fp, "%d.", &uptime);
+        fclose(fp);
+    }
 
-    if(delay > uptime)
-        sleep(delay - uptime);
+    if(delay > uptime) {
+        printf("delaying start by %d seconds\n", delay - uptime);
+        if (!dry_run)
+            sleep(delay - uptime);
+    }
 }
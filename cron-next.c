@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "schedule_index.h"
+
+/*
+ * Answers "what runs next" from the index the generator compiled,
+ * without asking systemd about every timer.
+ */
+
+static const struct schedule_index_header *header;
+static const struct schedule_entry *entries;
+static const char *strings;
+
+typedef struct firing
+{
+    int64_t when;
+    uint32_t entry;
+} firing;
+
+static firing *heap;
+static size_t heap_count;
+
+static void heap_push(int64_t when, uint32_t entry) {
+    size_t i = heap_count++;
+    while (i) {
+        size_t parent = (i - 1) / 2;
+        if (heap[parent].when <= when)
+            break;
+        heap[i] = heap[parent];
+        i = parent;
+    }
+    heap[i].when = when;
+    heap[i].entry = entry;
+}
+
+static firing heap_pop(void) {
+    firing top = heap[0];
+    firing last = heap[--heap_count];
+    size_t i = 0;
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= heap_count)
+            break;
+        if (child + 1 < heap_count && heap[child + 1].when < heap[child].when)
+            child++;
+        if (last.when <= heap[child].when)
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = last;
+    return top;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: cron-next [-n count] [--within minutes] [--at time] [--busiest [count]]\n"
+                    "                 [--from time] [--index file]\n");
+    exit(1);
+}
+
+/* "YYYY-MM-DD HH:MM", "HH:MM" (today) or "@epoch" */
+static int64_t parse_time(const char *text) {
+    struct tm tm;
+    time_t now = time(NULL);
+    localtime_r(&now, &tm);
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+
+    const char *end;
+    if (text[0] == '@')
+        return strtoll(text + 1, NULL, 10);
+    if (!(end = strptime(text, "%Y-%m-%d %H:%M", &tm)) &&
+        !(end = strptime(text, "%H:%M", &tm)))
+        usage();
+    if (*end)
+        usage();
+    return mktime(&tm);
+}
+
+static void print_firing(int64_t when, const struct schedule_entry *e) {
+    char buffer[32];
+    time_t t = when;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &tm);
+    printf("%s %s %s:%u\n", buffer, strings + e->unit, strings + e->source, e->line);
+}
+
+/* seed the heap with the first firing of every timer after <from> */
+static void seed(int64_t from) {
+    heap = malloc((header->count + 1) * sizeof(firing));
+    heap_count = 0;
+    for (uint32_t i = 0; i < header->count; i++) {
+        const struct schedule_entry *e = &entries[i];
+        // the first firing after the generator ran is still the first
+        // one after <from> as long as it has not happened yet
+        int64_t when = e->next;
+        if (from < header->generated || when <= from)
+            when = schedule_next(e, from);
+        if (when >= 0)
+            heap_push(when, i);
+    }
+}
+
+static void next(int64_t from, int count, int64_t until) {
+    seed(from);
+    while (heap_count && (count < 0 || count-- > 0)) {
+        firing f = heap_pop();
+        if (until >= 0 && f.when > until)
+            break;
+        print_firing(f.when, &entries[f.entry]);
+        int64_t when = schedule_next(&entries[f.entry], f.when);
+        if (when >= 0)
+            heap_push(when, f.entry);
+    }
+}
+
+static void at(int64_t when) {
+    time_t t = when;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    for (uint32_t i = 0; i < header->count; i++) {
+        const struct schedule_entry *e = &entries[i];
+        if (!(e->flags & SCHEDULE_REBOOT) && schedule_matches_day(e, &tm) &&
+            e->hours & (1u << tm.tm_hour) && e->minutes & (1ull << tm.tm_min))
+            print_firing(when - tm.tm_sec, e);
+    }
+}
+
+typedef struct minute
+{
+    int64_t when;
+    int jobs;
+} minute;
+
+static int minute_cmp(const void *a, const void *b) {
+    const minute *x = a, *y = b;
+    if (x->jobs != y->jobs)
+        return y->jobs - x->jobs;
+    return x->when < y->when ? -1 : x->when > y->when;
+}
+
+/* the minutes of the next day with the most timers going off together */
+static void busiest(int64_t from, int count) {
+    int64_t until = from + 24 * 60 * 60;
+    minute *minutes = NULL;
+    size_t minutes_count = 0;
+
+    seed(from);
+    while (heap_count) {
+        firing f = heap_pop();
+        if (f.when > until)
+            break;
+        if (!minutes_count || minutes[minutes_count - 1].when != f.when) {
+            if (minutes_count % 256 == 0)
+                minutes = realloc(minutes, (minutes_count + 256) * sizeof(minute));
+            minutes[minutes_count].when = f.when;
+            minutes[minutes_count++].jobs = 0;
+        }
+        minutes[minutes_count - 1].jobs++;
+        int64_t when = schedule_next(&entries[f.entry], f.when);
+        if (when >= 0)
+            heap_push(when, f.entry);
+    }
+
+    qsort(minutes, minutes_count, sizeof(minute), minute_cmp);
+    for (size_t i = 0; i < minutes_count && i < (size_t)count; i++) {
+        char buffer[32];
+        time_t t = minutes[i].when;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &tm);
+        printf("%s %d\n", buffer, minutes[i].jobs);
+    }
+    free(minutes);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"within",  required_argument, NULL, 'w'},
+        {"at",      required_argument, NULL, 'a'},
+        {"busiest", optional_argument, NULL, 'b'},
+        {"from",    required_argument, NULL, 'f'},
+        {"index",   required_argument, NULL, 'i'},
+        {NULL, 0, NULL, 0}
+    };
+    const char *index = SCHEDULE_INDEX;
+    int count = 10;
+    int within = -1;
+    int top = 0;
+    int64_t from = -1;
+    int64_t when = -1;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "n:", options, NULL)) != -1) {
+        switch (c) {
+            case 'n':
+                count = atoi(optarg);
+                break;
+            case 'w':
+                within = atoi(optarg);
+                break;
+            case 'a':
+                when = parse_time(optarg);
+                break;
+            case 'b':
+                top = optarg ? atoi(optarg) : 10;
+                break;
+            case 'f':
+                from = parse_time(optarg);
+                break;
+            case 'i':
+                index = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc)
+        usage();
+
+    int fd = open(index, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb)) {
+        perror(index);
+        exit(1);
+    }
+    void *map = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    header = map;
+    if (map == MAP_FAILED || (size_t)sb.st_size < sizeof(*header) ||
+        memcmp(header->magic, SCHEDULE_INDEX_MAGIC, sizeof(header->magic)) ||
+        (size_t)sb.st_size != sizeof(*header) + header->count * sizeof(struct schedule_entry) + header->strings_size) {
+        fprintf(stderr, "%s: not a schedule index\n", index);
+        exit(1);
+    }
+    entries = (const struct schedule_entry *)(header + 1);
+    strings = (const char *)(entries + header->count);
+
+    if (from < 0)
+        from = time(NULL);
+
+    if (when >= 0)
+        at(when);
+    else if (top)
+        busiest(from, top);
+    else if (within >= 0)
+        next(from, -1, from + within * 60);
+    else
+        next(from, count, -1);
+
+    munmap(map, sb.st_size);
+    return 0;
+}
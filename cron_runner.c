@@ -0,0 +1,386 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "schedule_index.h"
+
+/*
+ * Starts the jobs that fire every few minutes, that the generator left
+ * out of systemd (SCHEDULE_RUNNER in the schedule index), instead of
+ * having PID1 load a timer and fork a service for each of them.
+ *
+ * The jobs wait in a hierarchical timer wheel: one slot per minute of
+ * the coming hour, one slot per hour of the coming day, and a list for
+ * the rest, so a tick only looks at the jobs due in that minute.
+ */
+
+#define MINUTE_SLOTS 60
+#define HOUR_SLOTS 24
+#define STATS_EVERY 60
+
+typedef struct job
+{
+    struct schedule_entry entry;
+    char *unit;
+    char *source;
+    char *user;
+    char *script;
+    int64_t when;        // next firing, epoch seconds
+    pid_t pid;
+    struct job *next;    // in its wheel slot
+} job;
+
+static job *jobs = NULL;
+static size_t job_count = 0;
+
+static job *minute_slots[MINUTE_SLOTS];
+static job *hour_slots[HOUR_SLOTS];
+static job *later = NULL;
+static int64_t current = 0;   // last processed minute, epoch minutes
+
+static volatile sig_atomic_t stopping = 0;
+
+static const char *index_path = SCHEDULE_INDEX;
+// --simulate: print the firings instead of starting the jobs
+static bool simulating = false;
+
+static struct timespec index_mtime;
+static ino_t index_ino;
+
+static struct {
+    unsigned long ticks;
+    unsigned long firings;
+    unsigned long skipped;
+    double jitter_sum, jitter_max;        // ms
+    double overhead_sum, overhead_max;    // us
+} stats;
+
+static void insert(job *j) {
+    int64_t minute = j->when / 60;
+    int64_t delta = minute - current;
+    job **slot;
+    if (delta < MINUTE_SLOTS)
+        slot = &minute_slots[minute % MINUTE_SLOTS];
+    else if (delta < MINUTE_SLOTS * HOUR_SLOTS)
+        slot = &hour_slots[(minute / 60) % HOUR_SLOTS];
+    else
+        slot = &later;
+    j->next = *slot;
+    *slot = j;
+}
+
+static void schedule(job *j, int64_t after) {
+    j->when = schedule_next(&j->entry, after);
+    if (j->when >= 0)
+        insert(j);
+}
+
+static void rebuild(int64_t now) {
+    memset(minute_slots, 0, sizeof(minute_slots));
+    memset(hour_slots, 0, sizeof(hour_slots));
+    later = NULL;
+    current = now / 60;
+    for (size_t i = 0; i < job_count; i++)
+        schedule(&jobs[i], current * 60 + 59);
+}
+
+/* move the jobs of a slot of a higher level down, now that they are closer */
+static void cascade(job **slot) {
+    job *j = *slot;
+    *slot = NULL;
+    while (j) {
+        job *next = j->next;
+        insert(j);
+        j = next;
+    }
+}
+
+static void load(void) {
+    int fd = open(index_path, O_RDONLY);
+    struct stat sb;
+    if (fd < 0 || fstat(fd, &sb)) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    index_mtime = sb.st_mtim;
+    index_ino = sb.st_ino;
+
+    void *map = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    const struct schedule_index_header *header = map;
+    if (map == MAP_FAILED || (size_t)sb.st_size < sizeof(*header) ||
+        memcmp(header->magic, SCHEDULE_INDEX_MAGIC, sizeof(header->magic)) ||
+        (size_t)sb.st_size != sizeof(*header) + header->count * sizeof(struct schedule_entry) + header->strings_size) {
+        printf("<3>%s: not a schedule index\n", index_path);
+        if (map != MAP_FAILED)
+            munmap(map, sb.st_size);
+        return;
+    }
+    const struct schedule_entry *entries = (const struct schedule_entry *)(header + 1);
+    const char *strings = (const char *)(entries + header->count);
+
+    job *old = jobs;
+    size_t old_count = job_count;
+    jobs = NULL;
+    job_count = 0;
+
+    for (uint32_t i = 0; i < header->count; i++) {
+        const struct schedule_entry *e = &entries[i];
+        if (!(e->flags & SCHEDULE_RUNNER) || e->unit >= header->strings_size ||
+            e->source >= header->strings_size || e->user >= header->strings_size ||
+            e->script >= header->strings_size)
+            continue;
+        if (job_count % 64 == 0)
+            jobs = realloc(jobs, (job_count + 64) * sizeof(job));
+        job *j = &jobs[job_count++];
+        memset(j, 0, sizeof(*j));
+        j->entry = *e;
+        j->unit = strdup(strings + e->unit);
+        j->source = strdup(strings + e->source);
+        j->user = strdup(strings + e->user);
+        j->script = strdup(strings + e->script);
+        // don't start a job again while its previous run is still going
+        for (size_t k = 0; k < old_count; k++)
+            if (old[k].pid && !strcmp(old[k].unit, j->unit))
+                j->pid = old[k].pid;
+    }
+    munmap(map, sb.st_size);
+
+    for (size_t k = 0; k < old_count; k++) {
+        free(old[k].unit);
+        free(old[k].source);
+        free(old[k].user);
+        free(old[k].script);
+    }
+    free(old);
+    printf("%zu jobs loaded from %s\n", job_count, index_path);
+}
+
+static bool index_changed(void) {
+    struct stat sb;
+    if (stat(index_path, &sb))
+        return false;
+    return sb.st_ino != index_ino || sb.st_mtim.tv_sec != index_mtime.tv_sec ||
+           sb.st_mtim.tv_nsec != index_mtime.tv_nsec;
+}
+
+static void fire(job *j) {
+    if (simulating) {
+        // as cron-next prints them
+        char buffer[32];
+        time_t t = j->when;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(buffer, sizeof(buffer), "%Y-%m-%d %H:%M", &tm);
+        printf("%s %s %s:%u\n", buffer, j->unit, j->source, j->entry.line);
+        stats.firings++;
+        return;
+    }
+    if (j->pid) {
+        printf("<4>%s: previous run still active, skipping\n", j->unit);
+        stats.skipped++;
+        return;
+    }
+    struct passwd *pwd = getpwnam(j->user);
+    if (!pwd) {
+        printf("<3>%s: unknown user %s\n", j->unit, j->user);
+        return;
+    }
+
+    pid_t pid = fork();
+    if (pid == -1) {
+        printf("<3>%s: fork: %s\n", j->unit, strerror(errno));
+        return;
+    } else if (pid == 0) {
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigprocmask(SIG_SETMASK, &mask, NULL);
+        setsid();
+        if (setgid(pwd->pw_gid) || initgroups(pwd->pw_name, pwd->pw_gid) || setuid(pwd->pw_uid)) {
+            perror(j->unit);
+            _exit(1);
+        }
+        if (chdir(pwd->pw_dir))
+            chdir("/");
+        setenv("HOME", pwd->pw_dir, 1);
+        setenv("USER", pwd->pw_name, 1);
+        setenv("LOGNAME", pwd->pw_name, 1);
+        execl(j->script, j->script, NULL);
+        perror(j->script);
+        _exit(127);
+    }
+    j->pid = pid;
+    stats.firings++;
+}
+
+static void reap(void) {
+    int status;
+    pid_t pid;
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        for (size_t i = 0; i < job_count; i++)
+            if (jobs[i].pid == pid) {
+                jobs[i].pid = 0;
+                if (WIFEXITED(status) && WEXITSTATUS(status))
+                    printf("<3>%s: exited with status %d (%s:%u)\n", jobs[i].unit,
+                           WEXITSTATUS(status), jobs[i].source, jobs[i].entry.line);
+                else if (WIFSIGNALED(status))
+                    printf("<3>%s: killed by signal %d (%s:%u)\n", jobs[i].unit,
+                           WTERMSIG(status), jobs[i].source, jobs[i].entry.line);
+                break;
+            }
+}
+
+static void tick(int64_t minute) {
+    // the jobs of the hour, and of the day, get closer
+    if (minute % 60 == 0) {
+        cascade(&hour_slots[(minute / 60) % HOUR_SLOTS]);
+        cascade(&later);
+    }
+
+    job **slot = &minute_slots[minute % MINUTE_SLOTS];
+    job *j = *slot;
+    *slot = NULL;
+    while (j) {
+        job *next = j->next;
+        if (j->when / 60 == minute) {
+            fire(j);
+            schedule(j, minute * 60);
+        } else
+            insert(j);
+        j = next;
+    }
+}
+
+static void report(void) {
+    if (!stats.ticks)
+        return;
+    printf("%zu jobs, %lu started, %lu skipped; jitter %.3f ms average, %.3f ms max; "
+           "%.1f us per tick average, %.1f us max\n",
+           job_count, stats.firings, stats.skipped,
+           stats.jitter_sum / stats.ticks, stats.jitter_max,
+           stats.overhead_sum / stats.ticks, stats.overhead_max);
+    memset(&stats, 0, sizeof(stats));
+}
+
+static void stop(int signal) {
+    stopping = 1;
+}
+
+static double elapsed_us(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: cron_runner [--index file] [--simulate minutes [--from @epoch]]\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"index",    required_argument, NULL, 'i'},
+        {"simulate", required_argument, NULL, 's'},
+        {"from",     required_argument, NULL, 'f'},
+        {NULL, 0, NULL, 0}
+    };
+    int minutes = 0;
+    int64_t from = time(NULL);
+    int c;
+
+    while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+            case 'i':
+                index_path = optarg;
+                break;
+            case 's':
+                simulating = true;
+                minutes = atoi(optarg);
+                break;
+            case 'f':
+                if (optarg[0] != '@')
+                    usage();
+                from = strtoll(optarg + 1, NULL, 10);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc || minutes < 0)
+        usage();
+
+    // output of the jobs and ours must not be reordered in the journal
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    if (simulating) {
+        // the wheel, minute after minute, without waiting nor forking
+        load();
+        rebuild(from);
+        while (minutes--)
+            tick(++current);
+        return 0;
+    }
+
+    struct sigaction action = {.sa_handler = stop};
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGINT, &action, NULL);
+
+    load();
+    rebuild(time(NULL));
+
+    while (!stopping) {
+        struct timespec deadline = {.tv_sec = (current + 1) * 60, .tv_nsec = 0};
+        if (clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &deadline, NULL))
+            continue;
+
+        struct timespec woke, start;
+        clock_gettime(CLOCK_REALTIME, &woke);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        double jitter = (woke.tv_sec - deadline.tv_sec) * 1e3 + woke.tv_nsec / 1e6;
+
+        reap();
+        if (index_changed()) {
+            // from the last minute run: the ones just reached still fire
+            load();
+            rebuild(current * 60);
+        }
+
+        int64_t minute = woke.tv_sec / 60;
+        if (minute <= current)
+            continue;
+        if (minute - current > MINUTE_SLOTS) {
+            // the clock jumped, or we were suspended: no catch-up but this minute
+            printf("<4>clock jumped by %lld minutes, rescheduling\n", (long long)(minute - current));
+            rebuild((minute - 1) * 60);
+        }
+        while (current < minute)
+            tick(++current);
+
+        double overhead = elapsed_us(&start);
+        stats.ticks++;
+        stats.jitter_sum += jitter;
+        if (jitter > stats.jitter_max)
+            stats.jitter_max = jitter;
+        stats.overhead_sum += overhead;
+        if (overhead > stats.overhead_max)
+            stats.overhead_max = overhead;
+        if (stats.ticks == STATS_EVERY)
+            report();
+    }
+    report();
+    return 0;
+}
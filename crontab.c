@@ -0,0 +1,545 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef USER_CRONTABS
+#define USER_CRONTABS "/var/spool/cron/crontabs"
+#endif
+
+#ifndef GENERATOR
+#define GENERATOR "/usr/lib/systemd/system-generators/systemd-crontab-generator"
+#endif
+
+#define CRON_ALLOW "/etc/cron.allow"
+#define CRON_DENY "/etc/cron.deny"
+
+/*
+ * crontab is installed setuid root: the spool is not writable by users
+ * and only root can start and stop the generated units.
+ * Anything touching user supplied files runs with the real uid.
+ */
+static uid_t real_uid;
+static uid_t effective_uid;
+static const char *user;
+
+static void drop_privileges(void) {
+    if (seteuid(real_uid)) {}
+}
+
+static void restore_privileges(void) {
+    if (seteuid(effective_uid)) {}
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: crontab [-u user] file\n"
+                    "       crontab [-u user] [-l | -r | -e | -s] [-i]\n"
+                    "       crontab -t CRONTAB\n");
+    exit(1);
+}
+
+// 1: listed, 0: not listed, -1: no such file
+static int listed(const char *file, const char *name) {
+    FILE *fp = fopen(file, "r");
+    if (!fp)
+        return -1;
+    char line[256];
+    int found = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, " \t\r\n")] = '\0';
+        if (!strcmp(line, name)) {
+            found = 1;
+            break;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static bool allowed(const char *name) {
+    if (real_uid == 0)
+        return true;
+    int r = listed(CRON_ALLOW, name);
+    if (r >= 0)
+        return r;
+    r = listed(CRON_DENY, name);
+    if (r >= 0)
+        return !r;
+    // neither file: everyone can, as with Debian's cron
+    return true;
+}
+
+static char *read_stream(FILE *fp) {
+    char *content = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&content, &size);
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)))
+        fwrite(buffer, 1, n, out);
+    fclose(out);
+    return content;
+}
+
+static char *read_path(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    char *content = read_stream(fp);
+    fclose(fp);
+    return content;
+}
+
+/* with <as_user>, the command runs with the real uid */
+static int run(char *const argv[], bool as_user) {
+    int status;
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        if (as_user && (setgid(getgid()) || setuid(real_uid))) {
+            perror("setuid");
+            _exit(1);
+        }
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status))
+        return -1;
+    return WEXITSTATUS(status);
+}
+
+static char *spool_path(void) {
+    char *path;
+    asprintf(&path, "%s/%s", USER_CRONTABS, user);
+    return path;
+}
+
+// only this user's units, without a full daemon-reload
+static int apply(void) {
+    char *arg;
+    asprintf(&arg, "--user=%s", user);
+    char *argv[] = {GENERATOR, arg, "--apply", NULL};
+    int r = run(argv, false);
+    free(arg);
+    if (r) {
+        fprintf(stderr, "crontab: failed to update the units of %s\n", user);
+        return 1;
+    }
+    return 0;
+}
+
+static int validate(const char *path) {
+    char *check, *arg;
+    asprintf(&check, "--check=%s", path);
+    asprintf(&arg, "--user=%s", user);
+    char *argv[] = {GENERATOR, check, arg, NULL};
+    int r = run(argv, false);
+    free(check);
+    free(arg);
+    return r;
+}
+
+/* validate then atomically replace the user's crontab */
+static int install(const char *content, bool *invalid) {
+    struct passwd *pw = getpwnam(user);
+    mkdir("/var/spool/cron", 0755);
+    mkdir(USER_CRONTABS, 01730);
+
+    // dot files are ignored by the generator
+    char *tmp;
+    asprintf(&tmp, "%s/.%s.XXXXXX", USER_CRONTABS, user);
+    int fd = mkstemp(tmp);
+    if (fd < 0) {
+        fprintf(stderr, "crontab: cannot create %s: %s\n", tmp, strerror(errno));
+        free(tmp);
+        return 1;
+    }
+
+    size_t len = strlen(content);
+    bool ok = write(fd, content, len) == (ssize_t)len;
+    if (ok && len && content[len - 1] != '\n')
+        ok = write(fd, "\n", 1) == 1;
+    ok = ok && !fsync(fd);
+    if (!ok) {
+        fprintf(stderr, "crontab: cannot write %s: %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+
+    if (validate(tmp)) {
+        fprintf(stderr, "crontab: errors in crontab file, can't install\n");
+        if (invalid)
+            *invalid = true;
+        goto fail;
+    }
+
+    if (fchown(fd, pw->pw_uid, -1) || fchmod(fd, 0600)) {
+        fprintf(stderr, "crontab: cannot set owner of %s: %s\n", tmp, strerror(errno));
+        goto fail;
+    }
+    close(fd);
+
+    char *path = spool_path();
+    if (rename(tmp, path)) {
+        fprintf(stderr, "crontab: cannot install %s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        free(path);
+        free(tmp);
+        return 1;
+    }
+    free(path);
+    free(tmp);
+    return apply();
+
+fail:
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return 1;
+}
+
+static int replace(const char *file) {
+    FILE *fp;
+    drop_privileges();
+    if (!strcmp(file, "-"))
+        fp = stdin;
+    else
+        fp = fopen(file, "r");
+    restore_privileges();
+    if (!fp) {
+        fprintf(stderr, "crontab: %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    char *content = read_stream(fp);
+    if (fp != stdin)
+        fclose(fp);
+    int r = install(content, NULL);
+    free(content);
+    return r;
+}
+
+static int list(void) {
+    char *path = spool_path();
+    char *content = read_path(path);
+    free(path);
+    if (!content) {
+        fprintf(stderr, "no crontab for %s\n", user);
+        return 1;
+    }
+    fputs(content, stdout);
+    free(content);
+    return 0;
+}
+
+static bool confirm(const char *question) {
+    char answer[16];
+    fputs(question, stderr);
+    if (!fgets(answer, sizeof(answer), stdin))
+        return false;
+    return answer[0] == 'y' || answer[0] == 'Y';
+}
+
+static int remove_crontab(bool ask) {
+    char *path = spool_path();
+    struct stat sb;
+    if (stat(path, &sb) == -1) {
+        fprintf(stderr, "no crontab for %s\n", user);
+        free(path);
+        return 1;
+    }
+    if (ask) {
+        char *question;
+        asprintf(&question, "crontab: really delete %s's crontab? (y/n) ", user);
+        bool yes = confirm(question);
+        free(question);
+        if (!yes) {
+            free(path);
+            return 0;
+        }
+    }
+    if (unlink(path)) {
+        fprintf(stderr, "crontab: cannot remove %s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+    free(path);
+    return apply();
+}
+
+static int show(void) {
+    if (real_uid != 0) {
+        fprintf(stderr, "crontab: must be privileged to use -s\n");
+        return 1;
+    }
+    DIR *dirp = opendir(USER_CRONTABS);
+    if (!dirp)
+        return 0;
+    struct dirent *dent;
+    while ((dent = readdir(dirp)))
+        if (dent->d_name[0] != '.')
+            printf("%s\n", dent->d_name);
+    closedir(dirp);
+    return 0;
+}
+
+static int run_editor(const char *file) {
+    const char *editor = getenv("VISUAL");
+    if (!editor || !*editor)
+        editor = getenv("EDITOR");
+    if (!editor || !*editor)
+        editor = access("/usr/bin/editor", X_OK) ? "vi" : "/usr/bin/editor";
+
+    int status;
+    pid_t pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        return -1;
+    } else if (pid == 0) {
+        if (setgid(getgid()) || setuid(real_uid)) {
+            perror("setuid");
+            _exit(1);
+        }
+        // $EDITOR may contain arguments
+        execl("/bin/sh", "sh", "-c", "exec $0 \"$1\"", editor, file, NULL);
+        perror("/bin/sh");
+        _exit(127);
+    }
+    if (waitpid(pid, &status, 0) == -1 || !WIFEXITED(status) || WEXITSTATUS(status)) {
+        fprintf(stderr, "crontab: \"%s\" exited with an error\n", editor);
+        return -1;
+    }
+    return 0;
+}
+
+static int edit(void) {
+    char *path = spool_path();
+    char *original = read_path(path);
+    free(path);
+    if (!original)
+        original = strdup("# m h dom mon dow command\n");
+
+    char tmp[] = "/tmp/crontab.XXXXXX";
+    drop_privileges();
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        if (write(fd, original, strlen(original)) != (ssize_t)strlen(original))
+            perror(tmp);
+        close(fd);
+    }
+    restore_privileges();
+    if (fd < 0) {
+        perror("crontab: mkstemp");
+        free(original);
+        return 1;
+    }
+
+    int r = 1;
+    for (;;) {
+        if (run_editor(tmp))
+            break;
+
+        drop_privileges();
+        char *content = read_path(tmp);
+        restore_privileges();
+        if (!content) {
+            perror(tmp);
+            break;
+        }
+        if (!strcmp(content, original)) {
+            fprintf(stderr, "crontab: no changes made to crontab\n");
+            free(content);
+            r = 0;
+            break;
+        }
+
+        bool invalid = false;
+        r = install(content, &invalid);
+        free(content);
+        if (!invalid || !confirm("Do you want to retry the same edit? (y/n) "))
+            break;
+    }
+
+    drop_privileges();
+    if (r == 0)
+        unlink(tmp);
+    else
+        fprintf(stderr, "crontab: edits left in %s\n", tmp);
+    restore_privileges();
+    free(original);
+    return r;
+}
+
+static void remove_tree(const char *dir) {
+    DIR *dirp = opendir(dir);
+    if (dirp) {
+        struct dirent *dent;
+        while ((dent = readdir(dirp))) {
+            if (!strcmp(dent->d_name, ".") || !strcmp(dent->d_name, ".."))
+                continue;
+            char *path;
+            asprintf(&path, "%s/%s", dir, dent->d_name);
+            if (dent->d_type == DT_DIR)
+                remove_tree(path);
+            else
+                unlink(path);
+            free(path);
+        }
+        closedir(dirp);
+    }
+    rmdir(dir);
+}
+
+static int only_units(const struct dirent *dent) {
+    return dent->d_type == DT_REG && strcmp(dent->d_name, "schedule.idx");
+}
+
+/* show what the generator makes of a single line, as the user would get
+ * it: the generator must not look at the files of root for them */
+static int translate(const char *line) {
+    char dir[] = "/tmp/crontab.XXXXXX";
+    drop_privileges();
+    if (!mkdtemp(dir)) {
+        perror("crontab: mkdtemp");
+        restore_privileges();
+        return 1;
+    }
+
+    char *crontab, *output;
+    asprintf(&crontab, "%s/%s", dir, user);
+    asprintf(&output, "%s/units", dir);
+    mkdir(output, 0755);
+
+    FILE *fp = fopen(crontab, "w");
+    fprintf(fp, "%s\n", line);
+    fclose(fp);
+    restore_privileges();
+
+    char *check, *arg;
+    asprintf(&check, "--check=%s", crontab);
+    asprintf(&arg, "--user=%s", user);
+    char *argv[] = {GENERATOR, check, arg, output, NULL};
+    int r = run(argv, true) ? 1 : 0;
+
+    drop_privileges();
+    struct dirent **units;
+    int n = scandir(output, &units, only_units, alphasort);
+    for (int i = 0; i < n; i++) {
+        char *path;
+        asprintf(&path, "%s/%s", output, units[i]->d_name);
+        char *content = read_path(path);
+        printf("# %s\n%s\n", units[i]->d_name, content ? content : "");
+        free(content);
+        free(path);
+        free(units[i]);
+    }
+    if (n >= 0)
+        free(units);
+
+    remove_tree(dir);
+    restore_privileges();
+    free(check);
+    free(arg);
+    free(crontab);
+    free(output);
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"user",      required_argument, NULL, 'u'},
+        {"list",      no_argument,       NULL, 'l'},
+        {"remove",    no_argument,       NULL, 'r'},
+        {"edit",      no_argument,       NULL, 'e'},
+        {"show",      no_argument,       NULL, 's'},
+        {"ask",       no_argument,       NULL, 'i'},
+        {"translate", required_argument, NULL, 't'},
+        {}
+    };
+    char action = 0;
+    bool ask = false;
+    const char *line = NULL;
+    int c;
+
+    real_uid = getuid();
+    effective_uid = geteuid();
+
+    while ((c = getopt_long(argc, argv, "u:lresit:", options, NULL)) != -1) {
+        switch (c) {
+            case 'u':
+                user = optarg;
+                break;
+            case 'l':
+            case 'r':
+            case 'e':
+            case 's':
+                if (action)
+                    usage();
+                action = c;
+                break;
+            case 't':
+                if (action)
+                    usage();
+                action = c;
+                line = optarg;
+                break;
+            case 'i':
+                ask = true;
+                break;
+            default:
+                usage();
+        }
+    }
+
+    struct passwd *pw = getpwuid(real_uid);
+    if (!pw) {
+        fprintf(stderr, "crontab: your UID isn't in the passwd file\n");
+        exit(1);
+    }
+    if (user && real_uid != 0) {
+        fprintf(stderr, "crontab: must be privileged to use -u\n");
+        exit(1);
+    }
+    if (!user)
+        user = strdup(pw->pw_name);
+    if (!getpwnam(user)) {
+        fprintf(stderr, "crontab: user '%s' unknown\n", user);
+        exit(1);
+    }
+    if (!allowed(pw->pw_name)) {
+        fprintf(stderr, "crontab: you (%s) are not allowed to use this program\n", pw->pw_name);
+        exit(1);
+    }
+
+    if (!action) {
+        if (optind != argc - 1)
+            usage();
+        return replace(argv[optind]);
+    }
+    if (optind != argc)
+        usage();
+
+    switch (action) {
+        case 'l':
+            return list();
+        case 'r':
+            return remove_crontab(ask);
+        case 'e':
+            return edit();
+        case 's':
+            return show();
+        case 't':
+            return translate(line);
+    }
+    return 1;
+}
@@ -0,0 +1,85 @@
+/*
+ * libFuzzer target for parse_crontab(), run as by --check: dry-run,
+ * nothing written. The first byte picks how the rest is read: as a user
+ * crontab, a system crontab with a user field, or an anacrontab.
+ *
+ * Built with FUZZ_REPLAY, it is a plain program running the inputs
+ * given on the command line, for compilers without libFuzzer.
+ */
+
+#define main generator_main
+#include "../systemd-crontab-generator.c"
+#undef main
+
+static char dir[] = "/tmp/fuzz-crontab-XXXXXX";
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    static bool ready = false;
+    if (!ready) {
+        if (!mkdtemp(dir)) {
+            perror(dir);
+            exit(1);
+        }
+        dry_run = true;
+        debug = true;
+        ready = true;
+    }
+    if (!size)
+        return 0;
+
+    char *path;
+    asprintf(&path, "%s/crontab", dir);
+    FILE *fp = fopen(path, "w");
+    if (!fp) {
+        perror(path);
+        exit(1);
+    }
+    fwrite(data + 1, 1, size - 1, fp);
+    fclose(fp);
+
+    switch (data[0] % 3) {
+        case 0:
+            parse_crontab(dir, "crontab", "root", false);
+            break;
+        case 1:
+            parse_crontab(dir, "crontab", NULL, false);
+            break;
+        case 2:
+            parse_crontab(dir, "crontab", "root", true);
+            break;
+    }
+    write_catchup_dropins();
+
+    index_reset();
+    errors = 0;
+
+    unlink(path);
+    free(path);
+    return 0;
+}
+
+#ifdef FUZZ_REPLAY
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        FILE *fp = fopen(argv[i], "r");
+        if (!fp) {
+            perror(argv[i]);
+            return 1;
+        }
+        uint8_t *data = NULL;
+        size_t size = 0;
+        uint8_t buffer[4096];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+            data = realloc(data, size + n);
+            memcpy(data + size, buffer, n);
+            size += n;
+        }
+        fclose(fp);
+        LLVMFuzzerTestOneInput(data, size);
+        free(data);
+    }
+    rmdir(dir);
+    return 0;
+}
+#endif
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "job_metrics.h"
+
+static const char *metric_names[METRICS] = {
+	"cron_job_duration_seconds",
+	"cron_job_cpu_seconds",
+	"cron_job_memory_peak_bytes",
+	"cron_job_io_bytes",
+};
+
+// upper bounds, the last bucket is +Inf
+static const double bounds[METRICS][BUCKETS - 1] = {
+	{0.1, 0.5, 1, 5, 10, 30, 60, 300, 900, 3600, 14400},
+	{0.01, 0.1, 0.5, 1, 5, 10, 30, 60, 300, 900, 3600},
+	{1e6, 4e6, 16e6, 64e6, 128e6, 256e6, 512e6, 1e9, 2e9, 4e9, 8e9},
+	{1e5, 1e6, 1e7, 1e8, 2.5e8, 5e8, 1e9, 2.5e9, 5e9, 1e10, 1e11},
+};
+
+static uint64_t read_systemd_usec(const char *unit, const char *property) {
+	int filedes[2];
+	if (pipe(filedes) == -1)
+		return 0;
+
+	pid_t pid = fork();
+	if (pid == -1)
+		return 0;
+	else if (pid == 0) {
+		while ((dup2(filedes[1], STDOUT_FILENO) == -1) && (errno == EINTR)) {}
+		close(filedes[1]);
+		close(filedes[0]);
+		char *arg;
+		asprintf(&arg, "--property=%s", property);
+		execl("/usr/bin/systemctl", "systemctl", "show", "--value", unit, arg, NULL);
+		_exit(1);
+	}
+	close(filedes[1]);
+	char buffer[64];
+	memset(buffer, '\0', sizeof(buffer));
+	read(filedes[0], buffer, sizeof(buffer) - 1);
+	close(filedes[0]);
+	waitpid(pid, NULL, 0);
+	return strtoull(buffer, NULL, 10);
+}
+
+static uint64_t now_usec(clockid_t clock) {
+	struct timespec ts;
+	clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static char *own_cgroup(void) {
+	FILE *fp = fopen("/proc/self/cgroup", "r");
+	if (!fp)
+		return NULL;
+	char line[512];
+	char *path = NULL;
+	while (fgets(line, sizeof(line), fp)) {
+		// cgroup v2 only
+		if (strncmp(line, "0::", 3))
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+		asprintf(&path, "/sys/fs/cgroup%s", line + 3);
+		break;
+	}
+	fclose(fp);
+	return path;
+}
+
+static uint64_t read_cgroup_key(const char *cgroup, const char *file, const char *key) {
+	char *name;
+	asprintf(&name, "%s/%s", cgroup, file);
+	FILE *fp = fopen(name, "r");
+	free(name);
+	if (!fp)
+		return 0;
+
+	char word[64];
+	unsigned long long value, total = 0;
+	// cpu.stat is "key value" lines, io.stat is "maj:min key=value ..." lines
+	while (fscanf(fp, "%63s", word) == 1) {
+		size_t l = strlen(key);
+		if (key[l - 1] == '=') {
+			if (!strncmp(word, key, l) && sscanf(word + l, "%llu", &value) == 1)
+				total += value;
+		} else if (!strcmp(word, key) && fscanf(fp, "%llu", &value) == 1)
+			total += value;
+	}
+	fclose(fp);
+	return total;
+}
+
+static uint64_t read_cgroup_value(const char *cgroup, const char *file) {
+	char *name;
+	asprintf(&name, "%s/%s", cgroup, file);
+	FILE *fp = fopen(name, "r");
+	free(name);
+	unsigned long long value = 0;
+	if (fp) {
+		fscanf(fp, "%llu", &value);
+		fclose(fp);
+	}
+	return value;
+}
+
+static void account(struct metrics_header *h, int metric, double value) {
+	int b = 0;
+	while (b < BUCKETS - 1 && value > bounds[metric][b])
+		b++;
+	h->buckets[metric][b]++;
+	h->sums[metric] += value;
+}
+
+static int record(const char *unit) {
+	struct metrics_run r;
+	memset(&r, 0, sizeof(r));
+
+	// we run as ExecStopPost=, right after the main process exited
+	uint64_t start = read_systemd_usec(unit, "ExecMainStartTimestampMonotonic");
+	uint64_t exit = read_systemd_usec(unit, "ExecMainExitTimestampMonotonic");
+	uint64_t mono = now_usec(CLOCK_MONOTONIC);
+	if (start && start <= mono) {
+		r.start_usec = now_usec(CLOCK_REALTIME) - (mono - start);
+		r.duration_usec = (exit >= start ? exit : mono) - start;
+	} else
+		r.start_usec = now_usec(CLOCK_REALTIME);
+
+	const char *trigger = getenv("TRIGGER_TIMER_REALTIME_USEC");
+	if (trigger)
+		r.scheduled_usec = strtoull(trigger, NULL, 10);
+
+	const char *status = getenv("EXIT_STATUS");
+	if (status)
+		r.exit_status = atoi(status);
+	const char *result = getenv("SERVICE_RESULT");
+	r.failed = result && strcmp(result, "success");
+
+	char *cgroup = own_cgroup();
+	if (cgroup) {
+		r.cpu_usec = read_cgroup_key(cgroup, "cpu.stat", "usage_usec");
+		r.memory_peak = read_cgroup_value(cgroup, "memory.peak");
+		r.io_bytes = read_cgroup_key(cgroup, "io.stat", "rbytes=") +
+		             read_cgroup_key(cgroup, "io.stat", "wbytes=");
+		free(cgroup);
+	}
+
+	mkdir(STATE_DIR, 0755);
+	mkdir(METRICS_DIR, 0755);
+	char *name;
+	asprintf(&name, METRICS_DIR "/%s", unit);
+	int fd = open(name, O_RDWR | O_CREAT, 0644);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		perror(name);
+		free(name);
+		return 0;
+	}
+
+	struct metrics_header h;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, METRICS_MAGIC, sizeof(h.magic))) {
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, METRICS_MAGIC, sizeof(h.magic));
+	}
+	h.next %= RING_SIZE;
+
+	h.runs++;
+	if (r.failed)
+		h.failures++;
+	account(&h, DURATION, r.duration_usec / 1e6);
+	account(&h, CPU, r.cpu_usec / 1e6);
+	account(&h, MEMORY, r.memory_peak);
+	account(&h, IO, r.io_bytes);
+
+	if (pwrite(fd, &r, sizeof(r), sizeof(h) + h.next * sizeof(r)) != sizeof(r))
+		perror(name);
+	h.next = (h.next + 1) % RING_SIZE;
+	if (h.count < RING_SIZE)
+		h.count++;
+	if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+		perror(name);
+
+	close(fd);
+	free(name);
+	// never fail the job because of the bookkeeping
+	return 0;
+}
+
+static void export_job(FILE *out, const char *unit, int fd) {
+	struct metrics_header h;
+	struct metrics_run r;
+	if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || memcmp(h.magic, METRICS_MAGIC, sizeof(h.magic)) || !h.count)
+		return;
+	unsigned last = (h.next + RING_SIZE - 1) % RING_SIZE;
+	if (pread(fd, &r, sizeof(r), sizeof(h) + last * sizeof(r)) != sizeof(r))
+		return;
+
+	for (int m = 0; m < METRICS; m++) {
+		uint64_t cumulative = 0;
+		for (int b = 0; b < BUCKETS; b++) {
+			cumulative += h.buckets[m][b];
+			if (b < BUCKETS - 1)
+				fprintf(out, "%s_bucket{unit=\"%s\",le=\"%g\"} %llu\n",
+				        metric_names[m], unit, bounds[m][b], (unsigned long long)cumulative);
+			else
+				fprintf(out, "%s_bucket{unit=\"%s\",le=\"+Inf\"} %llu\n",
+				        metric_names[m], unit, (unsigned long long)cumulative);
+		}
+		fprintf(out, "%s_sum{unit=\"%s\"} %.6f\n", metric_names[m], unit, h.sums[m]);
+		fprintf(out, "%s_count{unit=\"%s\"} %llu\n", metric_names[m], unit, (unsigned long long)h.runs);
+	}
+	fprintf(out, "cron_job_failures_total{unit=\"%s\"} %llu\n", unit, (unsigned long long)h.failures);
+	fprintf(out, "cron_job_last_run_timestamp_seconds{unit=\"%s\"} %.3f\n", unit, r.start_usec / 1e6);
+	fprintf(out, "cron_job_last_exit_status{unit=\"%s\"} %d\n", unit, r.exit_status);
+	if (r.scheduled_usec && r.start_usec >= r.scheduled_usec)
+		fprintf(out, "cron_job_last_start_latency_seconds{unit=\"%s\"} %.3f\n",
+		        unit, (r.start_usec - r.scheduled_usec) / 1e6);
+}
+
+static int export(const char *output) {
+	FILE *out = stdout;
+	char *tmp = NULL;
+	if (output) {
+		// node_exporter may read the file at any time
+		asprintf(&tmp, "%s.tmp", output);
+		out = fopen(tmp, "w");
+		if (!out) {
+			perror(tmp);
+			return 1;
+		}
+	}
+
+	for (int m = 0; m < METRICS; m++)
+		fprintf(out, "# TYPE %s histogram\n", metric_names[m]);
+	fputs("# TYPE cron_job_failures_total counter\n", out);
+	fputs("# TYPE cron_job_last_run_timestamp_seconds gauge\n", out);
+	fputs("# TYPE cron_job_last_exit_status gauge\n", out);
+	fputs("# TYPE cron_job_last_start_latency_seconds gauge\n", out);
+
+	DIR *dirp = opendir(METRICS_DIR);
+	if (dirp) {
+		struct dirent *dent;
+		while ((dent = readdir(dirp))) {
+			if (dent->d_name[0] == '.')
+				continue;
+			int fd = openat(dirfd(dirp), dent->d_name, O_RDONLY);
+			if (fd < 0)
+				continue;
+			if (!flock(fd, LOCK_SH))
+				export_job(out, dent->d_name, fd);
+			close(fd);
+		}
+		closedir(dirp);
+	}
+
+	if (output) {
+		if (fclose(out) || rename(tmp, output)) {
+			perror(output);
+			free(tmp);
+			return 1;
+		}
+		free(tmp);
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if (argc == 3 && !strcmp(argv[1], "record"))
+		return record(argv[2]);
+	if ((argc == 2 || argc == 3) && !strcmp(argv[1], "export"))
+		return export(argc == 3 ? argv[2] : NULL);
+
+	fprintf(stderr, "Usage: %s record <unit>\n"
+	                "       %s export [<file.prom>]\n", argv[0], argv[0]);
+	exit(1);
+}
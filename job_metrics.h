@@ -0,0 +1,41 @@
+/*
+ * Run history of the jobs with METRICS=, written by job_metrics
+ * and read back by systemd-crontab-generator built with ADAPTIVE.
+ *
+ * One file per job: a header holding cumulative histograms, that are what
+ * Prometheus wants, followed by a ring of the last RING_SIZE runs.
+ */
+
+#include <stdint.h>
+
+#ifndef STATE_DIR
+#define STATE_DIR "/var/lib/systemd-cron"
+#endif
+#define METRICS_DIR STATE_DIR "/metrics"
+
+#define METRICS_MAGIC "CRONRUN1"
+#define RING_SIZE 64
+#define BUCKETS 12
+
+enum { DURATION, CPU, MEMORY, IO, METRICS };
+
+struct metrics_run {
+	uint64_t start_usec;     // realtime
+	uint64_t scheduled_usec; // realtime, 0 when not started by the timer
+	uint64_t duration_usec;
+	uint64_t cpu_usec;
+	uint64_t memory_peak;
+	uint64_t io_bytes;
+	int32_t exit_status;
+	uint32_t failed;
+};
+
+struct metrics_header {
+	char magic[8];
+	uint32_t next;
+	uint32_t count;
+	uint64_t runs;
+	uint64_t failures;
+	uint64_t buckets[METRICS][BUCKETS];
+	double sums[METRICS];
+};
@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Minimal run-parts(8) for the cron-<period>.service units:
+ * run the executables of a folder in lexical order, either one
+ * after the other or at most <jobs> at a time, and log how long
+ * each one took and how it exited.
+ */
+
+typedef struct part
+{
+    char *name;
+    char *path;
+    pid_t pid;
+    struct timespec start;
+} part;
+
+static char **excluded = NULL;
+static int excluded_count = 0;
+
+static void usage(void) {
+    fprintf(stderr, "Usage: run_parts [-j jobs] [-x name]... <directory>\n");
+    exit(1);
+}
+
+/* same naming rules as run-parts: skips *.dpkg-old, README.txt, ... */
+static int valid_name(const struct dirent *dent) {
+    if (!dent->d_name[0])
+        return 0;
+    for (const char *c = dent->d_name; *c; c++)
+        if (!(('a' <= *c && *c <= 'z') || ('A' <= *c && *c <= 'Z') ||
+              ('0' <= *c && *c <= '9') || *c == '_' || *c == '-'))
+            return 0;
+    for (int i = 0; i < excluded_count; i++)
+        if (!strcmp(dent->d_name, excluded[i]))
+            return 0;
+    return 1;
+}
+
+static double elapsed(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void start(part *p) {
+    clock_gettime(CLOCK_MONOTONIC, &p->start);
+    p->pid = fork();
+    if (p->pid == -1) {
+        perror("fork");
+    } else if (p->pid == 0) {
+        execl(p->path, p->path, NULL);
+        perror(p->path);
+        _exit(127);
+    }
+}
+
+/* returns true on success */
+static bool report(part *p, int status) {
+    double seconds = elapsed(&p->start);
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        printf("%s: exited successfully after %.3fs\n", p->name, seconds);
+        return true;
+    }
+    if (WIFEXITED(status))
+        printf("<3>%s: exited with status %d after %.3fs\n", p->name, WEXITSTATUS(status), seconds);
+    else if (WIFSIGNALED(status))
+        printf("<3>%s: killed by signal %d after %.3fs\n", p->name, WTERMSIG(status), seconds);
+    return false;
+}
+
+int main(int argc, char *argv[]) {
+    int jobs = 1;
+    int c;
+
+    while ((c = getopt(argc, argv, "j:x:")) != -1) {
+        switch (c) {
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs < 1)
+                    usage();
+                break;
+            case 'x':
+                excluded = realloc(excluded, (excluded_count + 1) * sizeof(char *));
+                excluded[excluded_count++] = optarg;
+                break;
+            default:
+                usage();
+        }
+    }
+    if (optind != argc - 1)
+        usage();
+    const char *dirname = argv[optind];
+
+    struct dirent **entries;
+    int n = scandir(dirname, &entries, valid_name, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "<3>cannot open %s: %s\n", dirname, strerror(errno));
+        exit(1);
+    }
+
+    part *parts = calloc(n, sizeof(part));
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        char *path;
+        struct stat sb;
+        asprintf(&path, "%s/%s", dirname, entries[i]->d_name);
+        if (stat(path, &sb) != -1 && S_ISREG(sb.st_mode) && !access(path, X_OK)) {
+            parts[count].name = strdup(entries[i]->d_name);
+            parts[count++].path = path;
+        } else
+            free(path);
+        free(entries[i]);
+    }
+    free(entries);
+
+    // output of the scripts and ours must not be reordered in the journal
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+
+    int next = 0, running = 0, failed = 0;
+    while (next < count || running) {
+        while (running < jobs && next < count) {
+            start(&parts[next]);
+            if (parts[next].pid > 0)
+                running++;
+            else
+                failed++;
+            next++;
+        }
+        if (!running)
+            break;
+
+        int status;
+        pid_t pid = wait(&status);
+        if (pid == -1) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (int i = 0; i < next; i++)
+            if (parts[i].pid == pid) {
+                if (!report(&parts[i], status))
+                    failed++;
+                parts[i].pid = 0;
+                running--;
+                break;
+            }
+    }
+
+    printf("%s: %d scripts, %d failed, %.3fs\n", dirname, count, failed, elapsed(&begin));
+
+    for (int i = 0; i < count; i++) {
+        free(parts[i].name);
+        free(parts[i].path);
+    }
+    free(parts);
+    free(excluded);
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,94 @@
+/*
+ * Compiled schedules of all the generated timers and of the jobs left
+ * to cron_runner, written by systemd-crontab-generator and mmap()ed
+ * by cron-next.
+ *
+ * layout: header, <count> entries, string table
+ */
+
+#include <stdint.h>
+#include <time.h>
+
+#ifndef SCHEDULE_INDEX
+#define SCHEDULE_INDEX "/run/systemd-cron/schedule.idx"
+#endif
+
+#define SCHEDULE_INDEX_MAGIC "CRONIDX2"
+
+// OnBootSec= only
+#define SCHEDULE_REBOOT 1
+// anacrontab period: checked daily, runs every <period> days
+#define SCHEDULE_PERIOD 2
+// no timer: started by cron_runner
+#define SCHEDULE_RUNNER 4
+
+// no user/script string
+#define SCHEDULE_NONE UINT32_MAX
+
+struct schedule_index_header {
+    char magic[8];
+    uint32_t count;
+    uint32_t strings_size;
+    int64_t generated;
+};
+
+struct schedule_entry {
+    uint64_t minutes;   // bit n: minute n
+    uint32_t hours;     // bit n: hour n
+    uint32_t days;      // bit n: day of month n, 1-31
+    uint16_t months;    // bit n: month n, 1-12
+    uint8_t weekdays;   // bit n: n=0 is sunday
+    uint8_t flags;
+    uint16_t period;
+    uint16_t reserved;
+    uint32_t line;
+    uint32_t unit;      // offsets in the string table
+    uint32_t source;
+    uint32_t user;      // runner jobs only, else SCHEDULE_NONE
+    uint32_t script;
+    uint32_t reserved2;
+    int64_t next;       // first firing after header.generated, -1 if none
+};
+
+static inline int schedule_matches_day(const struct schedule_entry *e, const struct tm *tm) {
+    // like systemd, and unlike cron, both day fields must match
+    return (e->months & (1 << (tm->tm_mon + 1))) &&
+           (e->days & (1u << tm->tm_mday)) &&
+           (e->weekdays & (1 << tm->tm_wday));
+}
+
+/* first firing strictly after <after>, in local time; -1 if none */
+static inline int64_t schedule_next(const struct schedule_entry *e, int64_t after) {
+    if (e->flags & SCHEDULE_REBOOT || !e->minutes || !e->hours)
+        return -1;
+
+    time_t t = after;
+    struct tm tm;
+    localtime_r(&t, &tm);
+    tm.tm_sec = 0;
+    tm.tm_min++;
+
+    // bounded: impossible dates like Feb 30 never match
+    for (int guard = 0; guard < 20000; guard++) {
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+        localtime_r(&t, &tm);
+        if (!(e->months & (1 << (tm.tm_mon + 1)))) {
+            tm.tm_mon++;
+            tm.tm_mday = 1;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!schedule_matches_day(e, &tm)) {
+            tm.tm_mday++;
+            tm.tm_hour = 0;
+            tm.tm_min = 0;
+        } else if (!(e->hours & (1u << tm.tm_hour))) {
+            tm.tm_hour++;
+            tm.tm_min = 0;
+        } else if (!(e->minutes & (1ull << tm.tm_min))) {
+            tm.tm_min++;
+        } else
+            return t;
+    }
+    return -1;
+}
@@ -53,17 +53,77 @@
 #include <string.h>
 #include <stdlib.h>
 #include <ctype.h>
+#include <limits.h>
 #include <pwd.h>
+#include <getopt.h>
+#include <time.h>
+#include <sys/wait.h>
+#include <sys/file.h>
 #include <md5.h>
 
+#include "schedule_index.h"
+#include "job_metrics.h"
+
 #ifndef USER_CRONTABS
 #define USER_CRONTABS "/var/spool/cron/crontabs"
 #endif
 // or "/var/spool/cron"
 
+// one cron-<period> unit running the whole folder
+// through run_parts instead of one unit per script
+#ifndef RUN_PARTS_JOBS
+#define RUN_PARTS_JOBS 1
+#endif
+
+#ifndef GENERATOR_DIR
+#define GENERATOR_DIR "/run/systemd/generator"
+#endif
+
 // do not re-run @reboot jobs
 // when switching from/to Vixie-Cron
+#ifndef REBOOT_FILE
 #define REBOOT_FILE "/run/crond.reboot"
+#endif
+
+// units generated at image build time by --root=,
+// installed as they are when the inputs didn't change
+#ifndef PREBUILT_DIR
+#define PREBUILT_DIR "/usr/lib/systemd-cron/prebuilt"
+#endif
+
+#ifndef GENERATOR_PATH
+#define GENERATOR_PATH "/usr/lib/systemd/system-generators/systemd-crontab-generator"
+#endif
+
+// heavy jobs, from the average of their recorded runs
+// (METRICS=), get a lower weight, or idle scheduling past
+// ten times the threshold; or a memory limited slice
+#ifndef ADAPTIVE_CPU
+#define ADAPTIVE_CPU 60 // seconds
+#endif
+#ifndef ADAPTIVE_IO
+#define ADAPTIVE_IO 1024 // MB
+#endif
+#ifndef ADAPTIVE_MEMORY
+#define ADAPTIVE_MEMORY 1024 // MB
+#endif
+#ifndef ADAPTIVE_MEMORY_HIGH
+#define ADAPTIVE_MEMORY_HIGH "50%"
+#endif
+#ifndef ADAPTIVE_MIN_RUNS
+#define ADAPTIVE_MIN_RUNS 3
+#endif
+#define RECLASSIFIED "/run/systemd-cron/reclassified"
+
+// users with lingering enabled get their crontab translated
+// by systemd-crontab-user-generator in their own user manager
+#ifndef LINGER_DIR
+#define LINGER_DIR "/var/lib/systemd/linger"
+#endif
+// where they find it, readable by them only
+#ifndef USER_MANAGER_CRONTABS
+#define USER_MANAGER_CRONTABS "/run/systemd-cron/crontabs"
+#endif
 
 typedef struct pair
 {
@@ -88,11 +148,24 @@ const pair CROND2TIMER[] = {
 
 
 static const char *arg_dest = "/tmp";
+// where the services find their .sh scripts, if not in arg_dest
+const char *scripts_dir = NULL;
 char *timers_dir = NULL;
 bool debug = false;
+// running as systemd-crontab-user-generator
+bool user_manager = false;
+const char *reboot_file = REBOOT_FILE;
+// --check without output folder
+bool dry_run = false;
+// invalid lines seen, reported by --check
+int errors = 0;
+
+// units written by this run, for --apply
+char **generated_units = NULL;
+size_t generated_count = 0;
 
 const char *daysofweek[] = {"Sun","Mon","Tue","Wed","Thu","Fri","Sat","Sun"};
-const char *isdow = "0123456";
+const char *isdow = "01234567";
 
 void log_msg(int level, char *message, char *message2) {
     FILE *out;
@@ -116,27 +189,26 @@ void log_msg(int level, char *message, char *message2) {
         fclose(out);
 }
 
-static int parse_dow(char *dow, char *dows){
+static int parse_dow(const char *dow, char *dows, size_t size){
     char c[2] = {"\0\0"};
+    size_t l = 0;
 
     dows[0] = '\0';
 
-    for(unsigned s = 0;s < strlen(dow);s++) {
+    for(unsigned s = 0; dow[s]; s++) {
         c[0] = dow[s];
+        const char *text = c;
         if (strchr(isdow, c[0]))
-            strncpy(dows + strlen(dows), daysofweek[atoi(&c[0])], 128 - strlen(dows));
+            text = daysofweek[c[0] - '0'];
         else if (c[0] == '*')
             continue;
-        else {
-            int l = strlen(dows);
-            if (l < 128) {
-                dows[l] = c[0];
-                dows[l+1] = '\0';
-            }
-        }
+        // truncated, but always terminated and with room for the blank
+        if (l + strlen(text) + 2 > size)
+            break;
+        strcpy(dows + l, text);
+        l += strlen(text);
     }
 
-    int l = strlen(dows);
     if (l) {
         dows[l] = ' ';
         dows[l+1] = '\0';
@@ -214,6 +286,385 @@ void compress_blanks(char *string) {
 }
 
 
+const char *month_names[] = {"jan","feb","mar","apr","may","jun","jul","aug","sep","oct","nov","dec",NULL};
+const char *dow_names[] = {"sun","mon","tue","wed","thu","fri","sat",NULL};
+
+#define ALL_MINUTES  ((1ull << 60) - 1)
+#define ALL_HOURS    ((1u << 24) - 1)
+#define ALL_DAYS     0xfffffffeu
+#define ALL_MONTHS   0x1ffe
+#define ALL_WEEKDAYS 0x7f
+
+static bool field_value(const char *text, const char **names, int first, int *value) {
+    char *end;
+    long v = strtol(text, &end, 10);
+    if (end != text && *end == '\0' && v >= INT_MIN && v <= INT_MAX) {
+        *value = v;
+        return true;
+    }
+    for (int i = 0; names && names[i]; i++)
+        if (!strcasecmp(text, names[i])) {
+            *value = i + first;
+            return true;
+        }
+    return false;
+}
+
+/* one crontab time field to a bitset, false if garbled */
+bool field_bits(const char *field, int min, int max, const char **names, uint64_t *bits) {
+    char *copy = strdup(field);
+    char *save = NULL;
+    bool ok = true;
+
+    *bits = 0;
+    for (char *item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save)) {
+        int start, end, step = 1;
+        char *slash = strchr(item, '/');
+        if (slash) {
+            slash[0] = '\0';
+            if (!field_value(slash + 1, NULL, 0, &step) || step < 1) {
+                ok = false;
+                break;
+            }
+        }
+
+        char *dash = strchr(item, '-');
+        if (!strcmp(item, "*")) {
+            start = min;
+            end = max;
+        } else if (dash) {
+            dash[0] = '\0';
+            ok = field_value(item, names, min, &start) && field_value(dash + 1, names, min, &end);
+        } else {
+            ok = field_value(item, names, min, &start);
+            end = slash ? max : start;
+        }
+
+        if (!ok || start < min || end > max || start > end) {
+            ok = false;
+            break;
+        }
+        for (int v = start; v <= end; v += step)
+            *bits |= 1ull << v;
+    }
+    free(copy);
+    return ok && *bits;
+}
+
+bool fields_entry(struct schedule_entry *entry, const char *m, const char *h,
+                  const char *dom, const char *mon, const char *dow) {
+    uint64_t bits[5];
+    if (!field_bits(m, 0, 59, NULL, &bits[0]) ||
+        !field_bits(h, 0, 23, NULL, &bits[1]) ||
+        !field_bits(dom, 1, 31, NULL, &bits[2]) ||
+        !field_bits(mon, 1, 12, month_names, &bits[3]) ||
+        !field_bits(dow, 0, 7, dow_names, &bits[4]))
+        return false;
+    entry->minutes = bits[0];
+    entry->hours = bits[1];
+    entry->days = bits[2];
+    entry->months = bits[3];
+    // 7 is sunday too
+    entry->weekdays = (bits[4] | bits[4] >> 7) & ALL_WEEKDAYS;
+    return true;
+}
+
+/* systemd has no crontab ranges: "1-5/2" becomes "1,3,5", names become numbers */
+char *expand_range(const char *field, const char **names, int first) {
+    // nothing to expand: no range, no name
+    if (!strchr(field, '-') && !(names && field[strspn(field, "0123456789*,/")]))
+        return strdup(field);
+
+    char *copy = strdup(field);
+    char *save = NULL;
+    char *expanded = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&expanded, &size);
+    const char *separator = "";
+
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *range = strdup(item);
+        char *slash = strchr(range, '/');
+        char *dash = strchr(range, '-');
+        int start, end, step = 1;
+        if (slash)
+            slash[0] = '\0';
+        if (dash && (!slash || dash < slash)) {
+            dash[0] = '\0';
+            if (field_value(range, names, first, &start) && field_value(dash + 1, names, first, &end) &&
+                (!slash || field_value(slash + 1, NULL, 0, &step)) &&
+                step >= 1 && start <= end && end - start <= 60) {
+                for (int v = start; v <= end; v += step) {
+                    fprintf(out, "%s%d", separator, v);
+                    separator = ",";
+                }
+                free(range);
+                continue;
+            }
+        } else if (!dash && names && field_value(range, names, first, &start)) {
+            // "jan" or "jul/2": systemd wants the number
+            fprintf(out, "%s%d%s", separator, start, slash ? item + (slash - range) : "");
+            separator = ",";
+            free(range);
+            continue;
+        }
+        fprintf(out, "%s%s", separator, item);
+        separator = ",";
+        free(range);
+    }
+    fclose(out);
+    free(copy);
+    return expanded;
+}
+
+/* anacron_stamp key of a job identifier: "_" is "__", and every other
+ * character but [A-Za-z0-9.-] is "_" and its hex code, so that two
+ * identifiers never share a stamp; false if empty or too long */
+bool stamp_key(const char *jobid, char *key, size_t size) {
+    size_t l = 0;
+    for (const unsigned char *c = (const unsigned char *)jobid; *c; c++) {
+        if (isalnum(*c) || *c == '.' || *c == '-') {
+            if (l + 2 > size)
+                return false;
+            key[l++] = *c;
+        } else if (*c == '_') {
+            if (l + 3 > size)
+                return false;
+            key[l++] = '_';
+            key[l++] = '_';
+        } else {
+            if (l + 4 > size)
+                return false;
+            l += sprintf(key + l, "_%02X", *c);
+        }
+    }
+    key[l] = '\0';
+    return l > 0;
+}
+
+/* what the @keywords, possibly delayed, mean for systemd */
+void keyword_entry(struct schedule_entry *entry, const char *keyword, int delay) {
+    int minute = delay >= 0 && delay < 60 ? delay : 0;
+    entry->minutes = 1ull << minute;
+    entry->hours = 1;
+    entry->days = ALL_DAYS;
+    entry->months = ALL_MONTHS;
+    entry->weekdays = ALL_WEEKDAYS;
+
+    if (!strcmp(keyword, "minutely"))
+        entry->minutes = ALL_MINUTES;
+    if (!strcmp(keyword, "minutely") || !strcmp(keyword, "hourly"))
+        entry->hours = ALL_HOURS;
+    else if (!strcmp(keyword, "weekly"))
+        entry->weekdays = 1 << 1;
+    else if (!strcmp(keyword, "monthly"))
+        entry->days = 1 << 1;
+    else if (!strcmp(keyword, "quarterly")) {
+        entry->days = 1 << 1;
+        entry->months = 1 << 1 | 1 << 4 | 1 << 7 | 1 << 10;
+    } else if (!strcmp(keyword, "semiannually")) {
+        entry->days = 1 << 1;
+        entry->months = 1 << 1 | 1 << 7;
+    } else if (!strcmp(keyword, "yearly")) {
+        entry->days = 1 << 1;
+        entry->months = 1 << 1;
+    }
+}
+
+struct schedule_entry *index_entries = NULL;
+size_t index_count = 0;
+char *index_strings = NULL;
+size_t index_strings_size = 0;
+
+static uint32_t index_string(const char *string) {
+    size_t l = strlen(string) + 1;
+    index_strings = realloc(index_strings, index_strings_size + l);
+    memcpy(index_strings + index_strings_size, string, l);
+    index_strings_size += l;
+    return index_strings_size - l;
+}
+
+void index_add(const struct schedule_entry *entry, const char *unit, const char *source,
+               const char *user, const char *script) {
+    if (dry_run)
+        return;
+    if (index_count % 256 == 0)
+        index_entries = realloc(index_entries, (index_count + 256) * sizeof(*entry));
+    index_entries[index_count] = *entry;
+    index_entries[index_count].unit = index_string(unit);
+    index_entries[index_count].source = index_string(source);
+    index_entries[index_count].user = user ? index_string(user) : SCHEDULE_NONE;
+    index_entries[index_count].script = script ? index_string(script) : SCHEDULE_NONE;
+    index_count++;
+}
+
+/* forget the entries added so far */
+void index_reset() {
+    free(index_entries);
+    free(index_strings);
+    index_entries = NULL;
+    index_strings = NULL;
+    index_count = 0;
+    index_strings_size = 0;
+}
+
+/* add the entries of an existing index, except those read from <skip>, a file or a folder/ */
+void index_load(const char *path, const char *skip) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    struct schedule_index_header header;
+    if (read(fd, &header, sizeof(header)) == sizeof(header) &&
+        !memcmp(header.magic, SCHEDULE_INDEX_MAGIC, sizeof(header.magic))) {
+        size_t size = header.count * sizeof(struct schedule_entry);
+        struct schedule_entry *entries = malloc(size);
+        char *strings = malloc(header.strings_size);
+        if (read(fd, entries, size) == (ssize_t)size && header.strings_size &&
+            read(fd, strings, header.strings_size) == (ssize_t)header.strings_size &&
+            !strings[header.strings_size - 1])
+            for (uint32_t i = 0; i < header.count; i++) {
+                struct schedule_entry *e = &entries[i];
+                if (e->unit >= header.strings_size || e->source >= header.strings_size)
+                    continue;
+                const char *source = strings + e->source;
+                size_t l = skip ? strlen(skip) : 0;
+                if (l && !strncmp(source, skip, l) && (skip[l - 1] == '/' || !source[l]))
+                    continue;
+                const char *user = e->user < header.strings_size ? strings + e->user : NULL;
+                const char *script = e->script < header.strings_size ? strings + e->script : NULL;
+                index_add(e, strings + e->unit, source, user, script);
+            }
+        free(entries);
+        free(strings);
+    }
+    close(fd);
+}
+
+void write_schedule_index(const char *path) {
+    struct schedule_index_header header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SCHEDULE_INDEX_MAGIC, sizeof(header.magic));
+    header.count = index_count;
+    header.strings_size = index_strings_size;
+    header.generated = time(NULL);
+
+    for (size_t i = 0; i < index_count; i++)
+        index_entries[i].next = schedule_next(&index_entries[i], header.generated);
+
+    char *dir = strdup(path);
+    *strrchr(dir, '/') = '\0';
+    mkdir(dir, 0755);
+    free(dir);
+
+    char *tmp;
+    asprintf(&tmp, "%s.tmp", path);
+    FILE *f = fopen(tmp, "w");
+    if (!f) {
+        log_msg(4, "cannot write ", tmp);
+        free(tmp);
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(index_entries, sizeof(struct schedule_entry), index_count, f);
+    fwrite(index_strings, 1, index_strings_size, f);
+    if (fclose(f) || rename(tmp, path))
+        log_msg(4, "cannot write ", (char *)path);
+    free(tmp);
+    index_reset();
+}
+
+#ifdef RUNNER_THRESHOLD
+/* longest wait in minutes between two firings within an active hour */
+static int minutes_gap(uint64_t minutes) {
+    int first = -1, last = -1, gap = 0;
+    for (int i = 0; i < 60; i++)
+        if (minutes & (1ull << i)) {
+            if (first < 0)
+                first = i;
+            else if (i - last > gap)
+                gap = i - last;
+            last = i;
+        }
+    if (first < 0)
+        return 60;
+    if (first + 60 - last > gap)
+        gap = first + 60 - last;
+    return gap;
+}
+
+/* MAILTO="": nothing to send when the job fails */
+static bool no_mail(env *head) {
+    for (env *curr = head; curr; curr = curr->next)
+        if (!strcmp(curr->key, "MAILTO"))
+            return !curr->val[0];
+    return false;
+}
+
+/* a self-contained script for cron_runner instead of a timer and a service */
+void generate_runner_job(const char *unit,
+                         struct schedule_entry *entry,
+                         const char *fullname,
+                         const char *user,
+                         const char *command,
+                         const char *shell,
+                         env *head) {
+    if (dry_run)
+        return;
+
+    char *outf, *script;
+    asprintf(&outf, "%s/%s.sh", arg_dest, unit);
+    asprintf(&script, "%s/%s.sh", scripts_dir ? scripts_dir : arg_dest, unit);
+    FILE *outp = fopen(outf, "w");
+    if (outp == NULL) {
+        log_msg(3, "Couldn't create output, aborting: ", outf);
+        exit(1);
+    }
+    fprintf(outp, "#!%s\n", shell);
+    for (env *curr = head; curr; curr = curr->next) {
+        fprintf(outp, "export %s='", curr->key);
+        for (const char *c = curr->val; *c; c++)
+            if (*c == '\'')
+                fputs("'\\''", outp);
+            else
+                fputc(*c, outp);
+        fputs("'\n", outp);
+    }
+    fprintf(outp, "%s\n", command);
+    fchmod(fileno(outp), 0755);
+    fclose(outp);
+
+    entry->flags |= SCHEDULE_RUNNER;
+    index_add(entry, unit, fullname, user, script);
+    free(outf);
+    free(script);
+}
+
+void generate_runner() {
+    char *unit;
+    asprintf(&unit, "%s/cron-runner.service", arg_dest);
+    FILE *f;
+    f = fopen(unit, "w");
+    fputs("[Unit]\n", f);
+    fputs("Description=Runner of the most frequent cron jobs\n", f);
+    fputs("Documentation=man:systemd.cron(7)\n", f);
+    fputs("PartOf=cron.target\n", f);
+    fputs("After=systemd-user-sessions.service remote-fs.target\n", f);
+
+    fputs("\n[Service]\n", f);
+    fputs("ExecStart=/usr/libexec/systemd-cron/cron_runner\n", f);
+    // restarting the runner must not kill the running jobs
+    fputs("KillMode=process\n", f);
+    fputs("Restart=on-failure\n", f);
+    fclose(f);
+
+    char *link;
+    asprintf(&link, "%s/cron-runner.service", timers_dir);
+    symlink(unit, link);
+    free(link);
+    free(unit);
+}
+#endif
+
 bool str_to_bool(char *string) {
     for (int i=0; string[i]; i++)
         string[i] = tolower((unsigned char)string[i]);
@@ -222,6 +673,154 @@ bool str_to_bool(char *string) {
            !strcmp(string,"1");
 }
 
+/* ADAPTIVE=, see crontab(5) */
+enum adaptive_policy {
+    ADAPTIVE_AUTO,
+    ADAPTIVE_NO,
+    ADAPTIVE_HEAVY,
+};
+
+#ifdef ADAPTIVE
+#define HEAVY_CPU      1
+#define IDLE_CPU       2
+#define HEAVY_IO       4
+#define IDLE_IO        8
+#define HEAVY_MEMORY  16
+
+// the jobs that got a lower priority, and why
+char *reclassified = NULL;
+size_t reclassified_size = 0;
+FILE *reclassified_stream = NULL;
+bool heavy_slice = false;
+
+/* average CPU seconds and IO bytes, and highest memory peak, of the last runs */
+static int job_cost(const char *unit, double *cpu, double *io, double *memory) {
+    char *name;
+    asprintf(&name, METRICS_DIR "/%s.service", unit);
+    int fd = open(name, O_RDONLY);
+    free(name);
+    if (fd < 0)
+        return 0;
+
+    int runs = 0;
+    struct metrics_header h;
+    struct metrics_run r;
+    *cpu = *io = *memory = 0;
+    if (!flock(fd, LOCK_SH) && pread(fd, &h, sizeof(h), 0) == sizeof(h) &&
+        !memcmp(h.magic, METRICS_MAGIC, sizeof(h.magic)))
+        for (unsigned i = 0; i < h.count && i < RING_SIZE; i++)
+            if (pread(fd, &r, sizeof(r), sizeof(h) + i * sizeof(r)) == sizeof(r)) {
+                *cpu += r.cpu_usec / 1e6;
+                *io += r.io_bytes;
+                if (r.memory_peak > *memory)
+                    *memory = r.memory_peak;
+                runs++;
+            }
+    close(fd);
+    if (runs) {
+        *cpu /= runs;
+        *io /= runs;
+    }
+    return runs;
+}
+
+static int adaptive_class(const char *unit, const char *fullname, const int adaptive) {
+    double cpu, io, memory;
+    int runs = 0;
+    int heavy = 0;
+
+    if (adaptive == ADAPTIVE_HEAVY)
+        heavy = HEAVY_CPU | IDLE_CPU | HEAVY_IO | IDLE_IO | HEAVY_MEMORY;
+    else if ((runs = job_cost(unit, &cpu, &io, &memory)) >= ADAPTIVE_MIN_RUNS) {
+        if (cpu > ADAPTIVE_CPU)
+            heavy |= HEAVY_CPU;
+        if (cpu > 10 * ADAPTIVE_CPU)
+            heavy |= IDLE_CPU;
+        if (io > ADAPTIVE_IO * 1e6)
+            heavy |= HEAVY_IO;
+        if (io > 10 * ADAPTIVE_IO * 1e6)
+            heavy |= IDLE_IO;
+        if (memory > ADAPTIVE_MEMORY * 1e6)
+            heavy |= HEAVY_MEMORY;
+    }
+    if (!heavy)
+        return 0;
+
+    char *reason;
+    if (adaptive == ADAPTIVE_HEAVY)
+        asprintf(&reason, "%s %s: ADAPTIVE=heavy", unit, fullname);
+    else
+        asprintf(&reason, "%s %s: %.1fs CPU%s, %.0fMB IO%s, %.0fMB memory%s, over %d runs",
+                 unit, fullname,
+                 cpu, heavy & IDLE_CPU ? " (idle)" : heavy & HEAVY_CPU ? " (low weight)" : "",
+                 io / 1e6, heavy & IDLE_IO ? " (idle)" : heavy & HEAVY_IO ? " (low weight)" : "",
+                 memory / 1e6, heavy & HEAVY_MEMORY ? " (cron-heavy.slice)" : "",
+                 runs);
+    log_msg(5, "reclassified ", reason);
+    if (!reclassified_stream)
+        reclassified_stream = open_memstream(&reclassified, &reclassified_size);
+    fprintf(reclassified_stream, "%s\n", reason);
+    free(reason);
+    return heavy;
+}
+
+/* the slice the memory hungry jobs share */
+void write_heavy_slice() {
+    if (!heavy_slice)
+        return;
+    char *unit;
+    asprintf(&unit, "%s/cron-heavy.slice", arg_dest);
+    FILE *f = fopen(unit, "w");
+    if (f) {
+        fputs("[Unit]\n", f);
+        fputs("Description=Cron jobs with a high memory usage\n", f);
+        fputs("Documentation=man:crontab(5)\n", f);
+        fputs("\n[Slice]\n", f);
+        fputs("MemoryHigh=" ADAPTIVE_MEMORY_HIGH "\n", f);
+        fclose(f);
+    }
+    free(unit);
+}
+
+/*
+ * the report of the demoted jobs, "<unit> <source>: <why>" per line;
+ * the lines of the sources matching <skip> are replaced, as in index_load()
+ */
+void write_reclassified(const char *skip) {
+    if (reclassified_stream)
+        fclose(reclassified_stream);
+    if (dry_run)
+        return;
+
+    mkdir("/run/systemd-cron", 0755);
+    FILE *f = fopen(RECLASSIFIED ".tmp", "w");
+    if (f) {
+        FILE *old = skip ? fopen(RECLASSIFIED, "r") : NULL;
+        size_t l = skip ? strlen(skip) : 0;
+        char line[1024];
+        while (old && fgets(line, sizeof(line), old)) {
+            char *source = strchr(line, ' ');
+            if (source && !strncmp(source + 1, skip, l) &&
+                (skip[l - 1] == '/' || source[l + 1] == ':'))
+                continue;
+            fputs(line, f);
+        }
+        if (old)
+            fclose(old);
+        if (reclassified)
+            fputs(reclassified, f);
+        if (fclose(f) || rename(RECLASSIFIED ".tmp", RECLASSIFIED))
+            log_msg(4, "cannot write ", RECLASSIFIED);
+    } else
+        log_msg(4, "cannot write ", RECLASSIFIED);
+    free(reclassified);
+    reclassified = NULL;
+    reclassified_stream = NULL;
+    write_heavy_slice();
+}
+
+#endif
+
 void generate_unit(const char *unit,
                    const char *line,
                    const char *fullname,
@@ -232,14 +831,26 @@ void generate_unit(const char *unit,
                    const bool anacrontab,
                    const char *user,
                    const int delay,
+                   const int period,
+                   const char *jobid,
                    const char *command,
                    const char *shell,
                    const bool batch,
+                   const char *gate,
+                   bool metrics,
+                   const int adaptive,
                    env *head) {
     env *curr = NULL;
     char *outf = NULL;
     FILE *outp = NULL;
 
+    if (dry_run)
+        return;
+
+    if (generated_count % 64 == 0)
+        generated_units = realloc(generated_units, (generated_count + 64) * sizeof(char *));
+    generated_units[generated_count++] = strdup(unit);
+
     asprintf(&outf, "%s/%s.timer", arg_dest, unit);
     outp = fopen(outf, "w");
     if(outp == NULL) {
@@ -255,9 +866,15 @@ void generate_unit(const char *unit,
     fputs("[Timer]\n", outp);
     if(reboot)
          fputs("OnBootSec=1m\n", outp);
-    else
+    else if (period) {
+         // anacron semantics: check at boot and then every day,
+         // anacron_stamp decides if the job is due
+         if (persistent)
+             fprintf(outp, "OnBootSec=%dm\n", delay);
+         fputs("OnCalendar=daily\n", outp);
+    } else
          fprintf(outp, "OnCalendar=%s\n", schedule);
-    if (persistent)
+    if (persistent && !period)
          fputs("Persistent=true\n", outp);
     fclose(outp);
 
@@ -273,18 +890,23 @@ void generate_unit(const char *unit,
     fprintf(outp, "Description=[Cron] \"%s\"\n", line);
     fputs("Documentation=man:systemd-crontab-generator(8)\n", outp);
     fprintf(outp, "SourcePath=%s\n", fullname);
-    if ((usertab && !anacrontab) || strcmp(user, "root")) {
+    if (user_manager) {
+        // nothing to do: already running as this user
+    } else if ((usertab && !anacrontab) || strcmp(user, "root")) {
         fputs("Requires=systemd-user-sessions.service\n", outp);
         struct passwd *pwd;
         pwd = getpwnam(user);
-        fprintf(outp, "RequiresMountsFor=%s\n", pwd->pw_dir);
+        if (pwd)
+            fprintf(outp, "RequiresMountsFor=%s\n", pwd->pw_dir);
     }
     fputs("\n", outp);
 
     fputs("[Service]\n", outp);
     fputs("Type=oneshot\n", outp);
     fputs("IgnoreSIGPIPE=false\n", outp);
-    if (!reboot && delay)
+    if (period)
+        fprintf(outp, "ExecCondition=/usr/libexec/systemd-cron/anacron_stamp %s %d\n", jobid, period);
+    else if (!reboot && delay)
         fprintf(outp, "ExecStartPre=-/usr/libexec/systemd-cron/boot_delay %d\n", delay);
 
     struct stat sb;
@@ -293,7 +915,7 @@ void generate_unit(const char *unit,
     else {
         char* script;
         asprintf(&script, "%s/%s.sh", arg_dest, unit);
-        fprintf(outp, "ExecStart=%s %s\n", shell, script);
+        fprintf(outp, "ExecStart=%s %s/%s.sh\n", shell, scripts_dir ? scripts_dir : arg_dest, unit);
         FILE *sh;
         sh = fopen(script, "w");
         fprintf(sh, "%s\n", command);
@@ -317,16 +939,155 @@ void generate_unit(const char *unit,
         fputs("\n", outp);
     }
 
-    fprintf(outp, "User=%s\n", user);
+    if (!user_manager)
+        fprintf(outp, "User=%s\n", user);
+    if (batch && gate)
+        fprintf(outp, "ExecStartPre=/usr/libexec/systemd-cron/batch_gate %s\n", gate);
     if (batch) {
         fputs("CPUSchedulingPolicy=idle\n", outp);
         fputs("IOSchedulingClass=idle\n", outp);
     }
+#ifdef ADAPTIVE
+    if (adaptive != ADAPTIVE_NO && !user_manager) {
+        // the history that the next runs of the generator look at
+        metrics = true;
+        int heavy = adaptive_class(unit, fullname, adaptive);
+        if (heavy & IDLE_CPU && !batch)
+            fputs("CPUSchedulingPolicy=idle\n", outp);
+        else if (heavy & HEAVY_CPU)
+            fputs("CPUWeight=20\n", outp);
+        if (heavy & IDLE_IO && !batch)
+            fputs("IOSchedulingClass=idle\n", outp);
+        else if (heavy & HEAVY_IO)
+            fputs("IOWeight=20\n", outp);
+        if (heavy & HEAVY_MEMORY) {
+            fputs("Slice=cron-heavy.slice\n", outp);
+            heavy_slice = true;
+        }
+    }
+#endif
+    if (metrics) {
+        fputs("CPUAccounting=yes\n", outp);
+        fputs("MemoryAccounting=yes\n", outp);
+        fputs("IOAccounting=yes\n", outp);
+        // a user manager has no privilege to run it, nor to write the records
+        if (!user_manager)
+            fputs("ExecStopPost=+/usr/libexec/systemd-cron/job_metrics record %n\n", outp);
+    }
 
     fclose(outp);
     free(outf);
 }
 
+/* catch-up of missed persistent jobs, see CATCHUP= in crontab(5) */
+enum catchup_policy {
+    CATCHUP_ALL,
+    CATCHUP_SKIP,
+    CATCHUP_STAGGER,
+};
+
+typedef struct catchup_job
+{
+    char *unit;
+    char *source;
+    int line;
+    int period;   // approximate period in minutes, shortest first
+    int window;   // minutes
+} catchup_job;
+
+catchup_job *catchup_jobs = NULL;
+size_t catchup_count = 0;
+
+// the policy in effect at the end of /etc/crontab, that used to run
+// the /etc/cron.<period> folders, applies to them
+enum catchup_policy parts_catchup = CATCHUP_ALL;
+int parts_catchup_window = 0;
+
+void catchup_add(const char *unit, const char *source, int line, int period, int window) {
+    if (catchup_count % 64 == 0)
+        catchup_jobs = realloc(catchup_jobs, (catchup_count + 64) * sizeof(catchup_job));
+    catchup_job *job = &catchup_jobs[catchup_count++];
+    job->unit = strdup(unit);
+    job->source = strdup(source);
+    job->line = line;
+    job->period = period;
+    job->window = window;
+}
+
+static int catchup_cmp(const void *a, const void *b) {
+    const catchup_job *x = a, *y = b;
+    if (x->window != y->window)
+        return x->window < y->window ? -1 : 1;
+    if (x->period != y->period)
+        return x->period < y->period ? -1 : 1;
+    int c = strcmp(x->source, y->source);
+    if (c)
+        return c;
+    return x->line - y->line;
+}
+
+/* spread the jobs sharing the same window evenly across it */
+void write_catchup_dropins() {
+    if (catchup_count)
+        qsort(catchup_jobs, catchup_count, sizeof(catchup_job), catchup_cmp);
+
+    size_t first = 0;
+    for (size_t i = 0; i < catchup_count; i++) {
+        if (catchup_jobs[i].window != catchup_jobs[first].window)
+            first = i;
+        size_t group = first;
+        while (group < catchup_count && catchup_jobs[group].window == catchup_jobs[first].window)
+            group++;
+
+        long offset = (long)catchup_jobs[i].window * 60 * (i - first) / (group - first);
+        if (offset && !dry_run) {
+            char *dir;
+            asprintf(&dir, "%s/%s.service.d", arg_dest, catchup_jobs[i].unit);
+            mkdir(dir, S_IRWXU | S_IRGRP | S_IXGRP | S_IROTH | S_IXOTH);
+            char *outf;
+            asprintf(&outf, "%s/catchup.conf", dir);
+            FILE *outp = fopen(outf, "w");
+            if (outp) {
+                fputs("[Service]\n", outp);
+                fprintf(outp, "ExecStartPre=-/usr/libexec/systemd-cron/boot_delay %lds\n", offset);
+                fclose(outp);
+            }
+            free(outf);
+            free(dir);
+        }
+    }
+
+    for (size_t i = 0; i < catchup_count; i++) {
+        free(catchup_jobs[i].unit);
+        free(catchup_jobs[i].source);
+    }
+    free(catchup_jobs);
+    catchup_jobs = NULL;
+    catchup_count = 0;
+}
+
+static int schedule_period(const char *schedule) {
+    if (!strcmp(schedule, "minutely")) return 1;
+    if (!strcmp(schedule, "hourly")) return 60;
+    if (!strcmp(schedule, "daily")) return 24 * 60;
+    if (!strcmp(schedule, "weekly")) return 7 * 24 * 60;
+    if (!strcmp(schedule, "monthly")) return 30 * 24 * 60;
+    if (!strcmp(schedule, "quarterly")) return 91 * 24 * 60;
+    if (!strcmp(schedule, "semiannually")) return 182 * 24 * 60;
+    if (!strcmp(schedule, "yearly")) return 365 * 24 * 60;
+    return 0;
+}
+
+/* rough estimate, only used for ordering */
+static int fields_period(const char *m, const char *h, const char *dom, const char *mon, const char *dow) {
+    if (strpbrk(m, "*,-/")) return 1;
+    if (strpbrk(h, "*,-/")) return 60;
+    if (!strcmp(dom, "*") && !strcmp(mon, "*") && !strcmp(dow, "*")) return 24 * 60;
+    if (strcmp(dow, "*")) return 7 * 24 * 60;
+    if (!strcmp(mon, "*")) return 30 * 24 * 60;
+    return 365 * 24 * 60;
+}
+
 static int parse_crontab(const char *dirname,
                          const char *filename,
                          const char *usertab,
@@ -339,14 +1100,31 @@ static int parse_crontab(const char *dirname,
     char shell[20] = "/bin/sh";
     char *p;
 
-    char frequency[11], m[25], h[25], dom[25], mon[25], dow[25], user[65];
-    char dows[128];
+    // long enough for "@semi-annually" and one more character; the
+    // time fields and the job identifier, as long as the line can hold
+    char frequency[16], m[sizeof(line)], h[sizeof(line)], dom[sizeof(line)];
+    char mon[sizeof(line)], dow[sizeof(line)], user[65];
+    // three letters for each digit of dow
+    char dows[3 * sizeof(line)];
     char *schedule;
     bool persistent = anacrontab;
     bool batch = false;
+    double batch_max_load = -1;
+    double batch_max_psi = -1;
+    int batch_max_wait = 60;
+    char *gate;
+    bool metrics = false;
+    enum adaptive_policy adaptive = ADAPTIVE_AUTO;
     bool reboot = false;
     int delay = 0;
-    char jobid[25];
+    int period = 0;
+    char jobid[sizeof(line)];
+    char stamp[56];
+    enum catchup_policy catchup = CATCHUP_ALL;
+    int catchup_window = 0;
+    int catchup_period = 0;
+    int lineno = 0;
+    struct schedule_entry entry;
 
     char *command;
     int skipped = 0;
@@ -362,6 +1140,13 @@ static int parse_crontab(const char *dirname,
     sequence *seq_curr = NULL;
     char *unit = NULL;
 
+    if (usertab && strlen(usertab) >= sizeof(user)) {
+        log_msg(3, "user name too long: ", fullname);
+        free(fullname);
+        errors++;
+        return -EINVAL;
+    }
+
     fp = fopen(fullname, "r");
     if (!fp) {
         log_msg(3, "cannot read ", fullname);
@@ -370,18 +1155,22 @@ static int parse_crontab(const char *dirname,
     }
 
     while (fgets(line, sizeof(line), fp)) {
+        lineno++;
         p = strchr(line, '\n');
-        p[0] = '\0';
+        if (p)
+            p[0] = '\0';
         compress_blanks(line);
         schedule = NULL;
         reboot = false;
+        period = 0;
+        memset(&entry, 0, sizeof(entry));
         switch(line[0]) {
             case '\0':
                 continue;
             case '#':
                 continue;
             case '@':
-                sscanf(line, "%10s %n", frequency, &skipped);
+                sscanf(line, "%15s %n", frequency, &skipped);
                 command = line + skipped;
                 if(!strcmp(frequency,"@minutely") ||
                    !strcmp(frequency,"@hourly") ||
@@ -403,16 +1192,22 @@ static int parse_crontab(const char *dirname,
                              schedule = strdup("yearly");
                 } else if (!strcmp(frequency,"@reboot")) {
                     struct stat sb;
-                    if (stat(REBOOT_FILE, &sb) != -1)
+                    if (stat(reboot_file, &sb) != -1)
                          continue;
                     schedule = strdup(&frequency[1]);
                     reboot = true;
                 } else {
                      log_msg(3, "garbled time: ", line);
+                     errors++;
                      continue;
                 }
                 if(anacrontab) {
-                     sscanf(command, "%4d %24s %n", &delay, jobid, &skipped);
+                     if (sscanf(command, "%4d %1023s %n", &delay, jobid, &skipped) != 2) {
+                         log_msg(3, "unsupported anacrontab: ", line);
+                         errors++;
+                         free(schedule);
+                         continue;
+                     }
                      command += skipped;
                 }
                 break;
@@ -440,6 +1235,7 @@ static int parse_crontab(const char *dirname,
                     if(strcmp("DELAY", line) == 0) {
                         if(!sscanf(value, "%d", &delay)) {
                             log_msg(4, "cannot read DELAY: ", value);
+                            errors++;
                             delay = 0;
                         }
                         continue;
@@ -450,14 +1246,77 @@ static int parse_crontab(const char *dirname,
                         continue;
                     }
 
+                    if(strcmp("CATCHUP", line) == 0) {
+                        int window;
+                        if (!strcmp(value, "all"))
+                            catchup = CATCHUP_ALL;
+                        else if (!strcmp(value, "skip"))
+                            catchup = CATCHUP_SKIP;
+                        else if (sscanf(value, "stagger:%d", &window) == 1 && window > 0) {
+                            catchup = CATCHUP_STAGGER;
+                            catchup_window = window;
+                        } else {
+                            log_msg(4, "cannot read CATCHUP: ", value);
+                            errors++;
+                        }
+                        continue;
+                    }
+
                     if(strcmp("BATCH", line) == 0) {
                         batch = str_to_bool(value);
                         continue;
                     }
 
+                    if(strcmp("BATCH_MAX_LOAD", line) == 0) {
+                        if(sscanf(value, "%lf", &batch_max_load) != 1 || batch_max_load < 0) {
+                            log_msg(4, "cannot read BATCH_MAX_LOAD: ", value);
+                            errors++;
+                            batch_max_load = -1;
+                        }
+                        continue;
+                    }
+
+                    if(strcmp("BATCH_MAX_PSI", line) == 0) {
+                        if(sscanf(value, "%lf", &batch_max_psi) != 1 || batch_max_psi < 0 || batch_max_psi > 100) {
+                            log_msg(4, "cannot read BATCH_MAX_PSI: ", value);
+                            errors++;
+                            batch_max_psi = -1;
+                        }
+                        continue;
+                    }
+
+                    if(strcmp("BATCH_MAX_WAIT", line) == 0) {
+                        if(sscanf(value, "%d", &batch_max_wait) != 1 || batch_max_wait < 0) {
+                            log_msg(4, "cannot read BATCH_MAX_WAIT: ", value);
+                            errors++;
+                            batch_max_wait = 60;
+                        }
+                        continue;
+                    }
+
+                    if(strcmp("METRICS", line) == 0) {
+                        metrics = str_to_bool(value);
+                        continue;
+                    }
+
+                    if(strcmp("ADAPTIVE", line) == 0) {
+                        if (!strcmp(value, "auto"))
+                            adaptive = ADAPTIVE_AUTO;
+                        else if (!strcmp(value, "no"))
+                            adaptive = ADAPTIVE_NO;
+                        else if (!strcmp(value, "heavy"))
+                            adaptive = ADAPTIVE_HEAVY;
+                        else {
+                            log_msg(4, "cannot read ADAPTIVE: ", value);
+                            errors++;
+                        }
+                        continue;
+                    }
+
                     if(strcmp("SHELL", line) == 0) {
                         if(strlen(value) > (sizeof(shell)-1)) {
                             log_msg(3, "bad SHELL, ingnoring: ", value);
+                            errors++;
                             continue;
                         }
                         strncpy(shell, value, sizeof(shell)-1);
@@ -470,25 +1329,14 @@ static int parse_crontab(const char *dirname,
 
              if(anacrontab) {
                  int days;
-                 sscanf(line, "%4d %4d %24s %n", &days, &delay, jobid, &skipped);
-                 command = line + skipped;
-                 switch(days) {
-                     case(1):
-                        schedule = strdup("daily");
-                        break;
-                     case(7):
-                        schedule = strdup("weekly");
-                        break;
-                     case(30):
-                        schedule = strdup("monthly");
-                        break;
-                     case(31):
-                        schedule = strdup("monthly");
-                        break;
-                     default:
-                        log_msg(3, "unsupported anacrontab", line);
-                        continue;
+                 if (sscanf(line, "%4d %4d %1023s %n", &days, &delay, jobid, &skipped) != 3 || days < 1) {
+                     log_msg(3, "unsupported anacrontab: ", line);
+                     errors++;
+                     continue;
                  }
+                 command = line + skipped;
+                 period = days;
+                 asprintf(&schedule, "%d days", days);
              } else {
                  if (!strcmp(fullname, "/etc/crontab")) {
                      if (strstr(line, "/etc/cron.hourly") != NULL) continue;
@@ -496,36 +1344,62 @@ static int parse_crontab(const char *dirname,
                      if (strstr(line, "/etc/cron.weekly") != NULL) continue;
                      if (strstr(line, "/etc/cron.monthly") != NULL) continue;
                  }
-                 sscanf(line, "%24s %24s %24s %24s %24s %n", m, h, dom, mon, dow, &skipped);
+                 if (sscanf(line, "%1023s %1023s %1023s %1023s %1023s %n", m, h, dom, mon, dow, &skipped) != 5 ||
+                     !fields_entry(&entry, m, h, dom, mon, dow)) {
+                     log_msg(3, "garbled time: ", line);
+                     errors++;
+                     continue;
+                 }
                  command = line + skipped;
              }
         }
         if (usertab == NULL) {
-            sscanf(command, "%64s %n", user, &skipped);
+            if (sscanf(command, "%64s %n", user, &skipped) != 1) {
+                log_msg(3, "missing user: ", line);
+                errors++;
+                free(schedule);
+                continue;
+            }
             command += skipped;
         } else
             strcpy(user, usertab);
 
+        if (command[0] == '\0') {
+            log_msg(3, "missing command: ", line);
+            errors++;
+            free(schedule);
+            continue;
+        }
+
+        entry.line = lineno;
+        if (reboot)
+            entry.flags = SCHEDULE_REBOOT;
+        else if (period) {
+            keyword_entry(&entry, "daily", 0);
+            entry.flags = SCHEDULE_PERIOD;
+            entry.period = period;
+        } else if (schedule)
+            keyword_entry(&entry, schedule, delay);
+
+        if (period)
+            catchup_period = period * 24 * 60;
+        else if (schedule)
+            catchup_period = schedule_period(schedule);
+        else
+            catchup_period = fields_period(m, h, dom, mon, dow);
+
         if (schedule == NULL) {
-           parse_dow(dow, &dows[0]);
-           void expand_range(char* var) {
-                if(!strchr(var, '-'))
-                    return;
-                char tmp[25];
-                strncpy(tmp, var, 24);
-                int start, end;
-                sscanf(strtok(tmp, "-"), "%d", &start);
-                sscanf(strtok(NULL, "-"), "%d", &end);
-                sprintf(var, "%d", start);
-                for(int i=start+1; i <= end; i++)
-                     sprintf(var + strlen(var),",%d", i);
-            }
-            expand_range(mon);
-            expand_range(dom);
-            expand_range(h);
-            expand_range(m);
-            asprintf(&schedule, "%s*-%s-%s %s:%s:00", dows, mon, dom, h, m);
-        } else if (delay) {
+            parse_dow(dow, dows, sizeof(dows));
+            char *months = expand_range(mon, month_names, 1);
+            char *days = expand_range(dom, NULL, 1);
+            char *hours = expand_range(h, NULL, 0);
+            char *minutes = expand_range(m, NULL, 0);
+            asprintf(&schedule, "%s*-%s-%s %s:%s:00", dows, months, days, hours, minutes);
+            free(months);
+            free(days);
+            free(hours);
+            free(minutes);
+        } else if (delay && !period) {
             char *delayed_schedule = NULL;
             if (!strcmp(schedule, "hourly"))
                 asprintf(&delayed_schedule, "*-*-* *:%d:0", delay);
@@ -547,47 +1421,91 @@ static int parse_crontab(const char *dirname,
             }
         }
 
-        if (persistent) {
-            unsigned char digest[16];
-            MD5_CTX context;
-            MD5Init(&context);
-            MD5Update(&context, (unsigned char *)schedule, strlen(schedule)+1);
-            MD5Update(&context, (unsigned char *)command, strlen(command));
-            MD5Final(digest, &context);
-            char md5[33];
-            for(int i = 0; i < 16; ++i)
-                sprintf(&md5[i*2], "%02x", (unsigned int)digest[i]);
-            if (anacrontab) {
-                int count = 0;
-                for (int i = 0; jobid[i]; i++)
-                    if (('a' <= jobid[i] && jobid[i] <= 'z') ||
-                       ('A' <= jobid[i] && jobid[i] <= 'Z') ||
-                       ('0' <= jobid[i] && jobid[i] <= '9'))
-                        jobid[count++] = jobid[i];
-                jobid[count] = '\0';
-                asprintf(&unit, "cron-%s-%s-%s", jobid, user, md5);
-            } else
-                asprintf(&unit, "cron-%s-%s-%s", filename, user, md5);
-        } else {
-            seq_curr = seq_head;
-            bool found = false;
-            while(seq_curr) {
-                if (strcmp(seq_curr->key, user) == 0) {
-                    seq_curr->val++;
-                    found = true;
-                    break;
-                }
-                seq_curr = seq_curr->next;
+        if (anacrontab) {
+            if (!stamp_key(jobid, stamp, sizeof(stamp))) {
+                log_msg(3, "unsupported anacrontab job identifier: ", line);
+                errors++;
+                free(schedule);
+                continue;
             }
-            if (!found) {
-                seq_curr = (sequence *)malloc(sizeof(sequence));
-                seq_curr->key = (char *)malloc(strlen(user)+1);
-                strcpy(seq_curr->key, user);
-                seq_curr->val = 0;
-                seq_curr->next = seq_head;
-                seq_head = seq_curr;
+            int count = 0;
+            for (int i = 0; jobid[i]; i++)
+                if (('a' <= jobid[i] && jobid[i] <= 'z') ||
+                   ('A' <= jobid[i] && jobid[i] <= 'Z') ||
+                   ('0' <= jobid[i] && jobid[i] <= '9'))
+                    jobid[count++] = jobid[i];
+            jobid[count] = '\0';
+            if (!count)
+                strcpy(jobid, "anacron");
+        }
+
+        // name units after their content, so that editing a crontab
+        // only renames the jobs that actually changed
+        unsigned char digest[16];
+        MD5_CTX context;
+        MD5Init(&context);
+        MD5Update(&context, (unsigned char *)schedule, strlen(schedule)+1);
+        MD5Update(&context, (unsigned char *)command, strlen(command));
+        MD5Final(digest, &context);
+        char md5[33];
+        for(int i = 0; i < 16; ++i)
+            sprintf(&md5[i*2], "%02x", (unsigned int)digest[i]);
+        char *base;
+        if (anacrontab)
+            asprintf(&base, "cron-%s-%s-%s", jobid, user, md5);
+        else
+            asprintf(&base, "cron-%s-%s-%s", filename, user, md5);
+
+        // ordinal among exact duplicates
+        seq_curr = seq_head;
+        bool found = false;
+        while(seq_curr) {
+            if (strcmp(seq_curr->key, base) == 0) {
+                seq_curr->val++;
+                found = true;
+                break;
             }
-            asprintf(&unit, "cron-%s-%s-%d", filename, user, seq_curr->val);
+            seq_curr = seq_curr->next;
+        }
+        if (!found) {
+            seq_curr = (sequence *)malloc(sizeof(sequence));
+            seq_curr->key = base;
+            seq_curr->val = 0;
+            seq_curr->next = seq_head;
+            seq_head = seq_curr;
+            unit = strdup(base);
+        } else {
+            asprintf(&unit, "%s-%d", base, seq_curr->val);
+            free(base);
+        }
+
+#ifdef RUNNER_THRESHOLD
+        // what a unit adds, the runner doesn't: failure mail, catch-up,
+        // boot delay, mounted home folders
+        if (!reboot && !period && !batch && !metrics && !user_manager &&
+            !(persistent && catchup != CATCHUP_SKIP) && !delay &&
+            !usertab && !strcmp(user, "root") && no_mail(head) &&
+#ifdef ADAPTIVE
+            adaptive != ADAPTIVE_HEAVY &&
+#endif
+            minutes_gap(entry.minutes) <= RUNNER_THRESHOLD) {
+            generate_runner_job(unit, &entry, fullname, user, command, shell, head);
+            free(schedule);
+            free(unit);
+            continue;
+        }
+#endif
+
+        gate = NULL;
+        if (batch && (batch_max_load >= 0 || batch_max_psi >= 0)) {
+            size_t size;
+            FILE *args = open_memstream(&gate, &size);
+            if (batch_max_load >= 0)
+                fprintf(args, "-l %g ", batch_max_load);
+            if (batch_max_psi >= 0)
+                fprintf(args, "-p %g ", batch_max_psi);
+            fprintf(args, "-w %d", batch_max_wait);
+            fclose(args);
         }
 
         generate_unit(
@@ -596,19 +1514,33 @@ static int parse_crontab(const char *dirname,
                    fullname,
                    reboot,
                    schedule,
-                   persistent,
+                   persistent && catchup != CATCHUP_SKIP,
                    usertab,
                    anacrontab,
                    user,
                    delay,
+                   period,
+                   stamp,
                    command,
                    shell,
                    batch,
+                   gate,
+                   metrics,
+                   adaptive,
                    head);
 
+        if (persistent && !reboot && catchup == CATCHUP_STAGGER)
+            catchup_add(unit, fullname, lineno, catchup_period, catchup_window);
+        index_add(&entry, unit, fullname, NULL, NULL);
+
+        free(gate);
         free(schedule);
         free(unit);
     }
+    if (!strcmp(fullname, "/etc/crontab")) {
+        parts_catchup = catchup;
+        parts_catchup_window = catchup_window;
+    }
     free(fullname);
     fclose(fp);
 
@@ -648,6 +1580,63 @@ bool is_masked(const char *unit_name, const pair *distro) {
     return false;
 }
 
+bool is_lingering(const char *user) {
+#ifdef USER_MANAGER
+    struct stat sb;
+    char *linger;
+    asprintf(&linger, "%s/%s", LINGER_DIR, user);
+    bool lingering = stat(linger, &sb) != -1;
+    free(linger);
+    return lingering;
+#else
+    return false;
+#endif
+}
+
+/* a lingering user gets its jobs generated by its own user manager, from a
+ * copy of its crontab: the spool itself stays out of reach of the users */
+bool hand_to_user_manager(const char *user) {
+#ifdef USER_MANAGER
+    if (!is_lingering(user))
+        return false;
+    char *spool, *copy, *tmp;
+    asprintf(&spool, "%s/%s", USER_CRONTABS, user);
+    asprintf(&copy, "%s/%s", USER_MANAGER_CRONTABS, user);
+    asprintf(&tmp, "%s/.%s.XXXXXX", USER_MANAGER_CRONTABS, user);
+    bool handed = false;
+    struct passwd *pwd = getpwnam(user);
+    FILE *in = fopen(spool, "r");
+    if (!in) {
+        // no crontab anymore: the user manager drops its units
+        handed = errno == ENOENT && (!unlink(copy) || errno == ENOENT);
+    } else {
+        mkdir("/run/systemd-cron", 0755);
+        mkdir(USER_MANAGER_CRONTABS, 0711);
+        int fd = pwd ? mkstemp(tmp) : -1;
+        FILE *out = fd < 0 ? NULL : fdopen(fd, "w");
+        if (out) {
+            char buffer[4096];
+            size_t n;
+            while ((n = fread(buffer, 1, sizeof(buffer), in)) > 0)
+                fwrite(buffer, 1, n, out);
+            handed = !ferror(in) && !fchown(fd, pwd->pw_uid, pwd->pw_gid) && !fchmod(fd, 0400);
+            handed = !fclose(out) && handed && !rename(tmp, copy);
+            if (!handed)
+                unlink(tmp);
+        }
+        fclose(in);
+    }
+    if (!handed)
+        log_msg(4, "cannot hand the crontab to the user manager, generating system units: ", spool);
+    free(spool);
+    free(copy);
+    free(tmp);
+    return handed;
+#else
+    return false;
+#endif
+}
+
 int parse_dir(const bool system, const char *dirname) {
     DIR *dirp;
     struct dirent *dent;
@@ -670,6 +1659,8 @@ int parse_dir(const bool system, const char *dirname) {
                continue;
             }
             parse_crontab(dirname, dent->d_name, NULL, false);
+        } else if (hand_to_user_manager(dent->d_name)) {
+            log_msg(6, "left to the user manager: ", dent->d_name);
         } else {
             parse_crontab(dirname, dent->d_name, dent->d_name, false);
         }
@@ -691,6 +1682,18 @@ int parse_parts_dir(const char *period, const int delay) {
         return 0;
     }
 
+#ifdef RUN_PARTS
+    char *command;
+    size_t size;
+    FILE *cmd = open_memstream(&command, &size);
+    fprintf(cmd, "/usr/libexec/systemd-cron/run_parts -j %d -x 0anacron", RUN_PARTS_JOBS);
+#endif
+
+    // OnCalendar=<period> fires at minute 0: the delay is only the boot delay
+    struct schedule_entry entry;
+    memset(&entry, 0, sizeof(entry));
+    keyword_entry(&entry, period, 0);
+
     char *fullname;
     char *unit;
     while ((dent = readdir(dirp))) {
@@ -715,31 +1718,77 @@ int parse_parts_dir(const char *period, const int delay) {
         };
         if (is_masked(dent->d_name, PART2TIMER)) {
             log_msg(5, "ignoring because native timer is present: ", fullname);
+#ifdef RUN_PARTS
+            fprintf(cmd, " -x %s", dent->d_name);
+#endif
             free(fullname);
             free(unit);
             continue;
         }
 
+#ifndef RUN_PARTS
         generate_unit(
             unit,       //unit
             fullname,   //line (bad)
             fullname,   //fullname
             false,      //reboot
             period,     //schedule
-            true,       //peristent
+            parts_catchup != CATCHUP_SKIP, //persistent
             false,      //usertab
             false,      //anacrontab
             "root",     //user
             delay,      //delay
+            0,          //period
+            NULL,       //jobid
             fullname,   //command
             "/bin/sh",  //shell
             false,      //batch
+            NULL,       //gate
+            false,      //metrics
+            ADAPTIVE_AUTO, //adaptive
             NULL        //environment
         );
+        index_add(&entry, unit, fullname, NULL, NULL);
+        if (parts_catchup == CATCHUP_STAGGER)
+            catchup_add(unit, fullname, 0, schedule_period(period), parts_catchup_window);
+#endif
         free(fullname);
         free(unit);
     }
     closedir(dirp);
+
+#ifdef RUN_PARTS
+    fprintf(cmd, " %s", dirname);
+    fclose(cmd);
+    asprintf(&unit, "cron-%s", period);
+    generate_unit(
+        unit,       //unit
+        dirname,    //line
+        dirname,    //fullname
+        false,      //reboot
+        period,     //schedule
+        parts_catchup != CATCHUP_SKIP, //persistent
+        false,      //usertab
+        false,      //anacrontab
+        "root",     //user
+        delay,      //delay
+        0,          //period
+        NULL,       //jobid
+        command,    //command
+        "/bin/sh",  //shell
+        false,      //batch
+        NULL,       //gate
+        false,      //metrics
+        ADAPTIVE_AUTO, //adaptive
+        NULL        //environment
+    );
+    index_add(&entry, unit, dirname, NULL, NULL);
+    if (parts_catchup == CATCHUP_STAGGER)
+        catchup_add(unit, dirname, 0, schedule_period(period), parts_catchup_window);
+    free(command);
+    free(unit);
+#endif
+
     free(dirname);
     return 0;
 }
@@ -772,23 +1821,409 @@ void workaround_var_not_mounted() {
     free(unit);
 }
 
-int main(int argc, char *argv[]) {
-    if (argc > 1)
-        arg_dest = argv[1];
-    else
-        debug = true;
+#ifdef DEFER_USER_CRONTABS
+/* at boot, leave the user spool to a late pass off the critical path */
+void defer_user_crontabs() {
+    char *unit;
+    asprintf(&unit, "%s/cron-user-crontabs.service", arg_dest);
+    FILE *f;
+    f = fopen(unit, "w");
+    fputs("[Unit]\n", f);
+    fputs("Description=Translate the users crontabs\n", f);
+    fputs("Documentation=man:systemd-crontab-generator(8)\n", f);
+    fputs("After=cron.target\n", f);
+    fputs("RequiresMountsFor=" USER_CRONTABS "\n", f);
+
+    fputs("\n[Service]\n", f);
+    fputs("Type=oneshot\n", f);
+    fputs("Nice=19\n", f);
+    fputs("CPUSchedulingPolicy=idle\n", f);
+    fputs("IOSchedulingClass=idle\n", f);
+    fputs("ExecStart=" GENERATOR_PATH " --all-users\n", f);
+    fclose(f);
+
+    char *dir;
+    asprintf(&dir, "%s/multi-user.target.wants", arg_dest);
+    mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    free(dir);
+
+    char *link;
+    asprintf(&link, "%s/multi-user.target.wants/cron-user-crontabs.service", arg_dest);
+    symlink(unit, link);
+    free(link);
+    free(unit);
+}
+#endif
+
+static char *read_file(const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (!fp)
+        return NULL;
+    char *content = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&content, &size);
+    char buffer[4096];
+    size_t n;
+    while ((n = fread(buffer, 1, sizeof(buffer), fp)))
+        fwrite(buffer, 1, n, out);
+    fclose(out);
+    fclose(fp);
+    return content;
+}
+
+/* "cron-<user>-<user>-<md5>[-<n>].<ext>" -> "cron-<user>-<user>-<md5>[-<n>]" */
+static char *user_unit_name(const char *name, const char *user) {
+    char *prefix;
+    asprintf(&prefix, "cron-%s-%s-", user, user);
+    size_t l = strlen(prefix);
+    bool match = !strncmp(name, prefix, l);
+    free(prefix);
+    if (!match)
+        return NULL;
+
+    const char *p = name + l;
+    for (int i = 0; i < 32; i++, p++)
+        if (!isxdigit((unsigned char)*p))
+            return NULL;
+    if (*p == '-') {
+        if (!isdigit((unsigned char)*++p))
+            return NULL;
+        while (isdigit((unsigned char)*p))
+            p++;
+    }
+    if (strcmp(p, ".timer") && strcmp(p, ".service") && strcmp(p, ".sh") && strcmp(p, ".service.d"))
+        return NULL;
+    return strndup(name, p - name);
+}
+
+/* everything generated for one unit, to notice changes */
+static char *unit_signature(const char *unit) {
+    static const char *suffixes[] = {".timer", ".service", ".sh", ".service.d/catchup.conf", NULL};
+    char *signature = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&signature, &size);
+    for (int i = 0; suffixes[i]; i++) {
+        char *path;
+        asprintf(&path, "%s/%s%s", arg_dest, unit, suffixes[i]);
+        char *content = read_file(path);
+        fprintf(out, "%s\n%s\n", suffixes[i], content ? content : "");
+        free(content);
+        free(path);
+    }
+    fclose(out);
+    return signature;
+}
+
+static void remove_unit_files(const char *unit, bool all) {
+    char *path;
+    asprintf(&path, "%s/%s.service.d/catchup.conf", arg_dest, unit);
+    unlink(path);
+    free(path);
+    asprintf(&path, "%s/%s.service.d", arg_dest, unit);
+    rmdir(path);
+    free(path);
+    if (!all)
+        return;
+
+    static const char *suffixes[] = {".timer", ".service", ".sh", NULL};
+    for (int i = 0; suffixes[i]; i++) {
+        asprintf(&path, "%s/%s%s", arg_dest, unit, suffixes[i]);
+        unlink(path);
+        free(path);
+    }
+    asprintf(&path, "%s/%s.timer", timers_dir, unit);
+    unlink(path);
+    free(path);
+}
+
+static int systemctl(const char *verb, char **units, size_t count) {
+    if (units && !count)
+        return 0;
+
+    char **args = calloc(count + 3, sizeof(char *));
+    args[0] = "systemctl";
+    args[1] = (char *)verb;
+    for (size_t i = 0; i < count; i++)
+        asprintf(&args[i + 2], "%s.timer", units[i]);
+
+    int status = -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        execv("/usr/bin/systemctl", args);
+        _exit(127);
+    } else if (pid > 0)
+        waitpid(pid, &status, 0);
+
+    for (size_t i = 0; i < count; i++)
+        free(args[i + 2]);
+    free(args);
+    return status;
+}
+
+/* only this user's manager reruns systemd-crontab-user-generator */
+static void reload_user_manager(const char *user) {
+    char *machine;
+    asprintf(&machine, "--machine=%s@.host", user);
+    const char *verbs[][2] = {{"daemon-reload", NULL}, {"restart", "cron.target"}};
+    for (int i = 0; i < 2; i++) {
+        pid_t pid = fork();
+        if (pid == 0) {
+            execl("/usr/bin/systemctl", "systemctl", "--user", machine, verbs[i][0], verbs[i][1], NULL);
+            _exit(127);
+        } else if (pid > 0)
+            waitpid(pid, NULL, 0);
+    }
+    free(machine);
+}
+
+static bool unit_in(const char *unit, char **units, size_t count) {
+    for (size_t i = 0; i < count; i++)
+        if (!strcmp(unit, units[i]))
+            return true;
+    return false;
+}
 
+/*
+ * Regenerate the units of a single user crontab in place and only
+ * start/stop what changed: thanks to the content based unit names,
+ * new jobs are new units that systemd loads on demand without a
+ * global daemon-reload.
+ */
+static int apply_user(const char *user) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // all or nothing: a crontab that --check rejects changes no unit
+    char *spool;
     struct stat sb;
-    if (stat(arg_dest, &sb) == -1) {
-        fprintf(stderr, "%s doesn't exist.\n", arg_dest);
+    asprintf(&spool, "%s/%s", USER_CRONTABS, user);
+    bool handed = hand_to_user_manager(user);
+    if (!handed && stat(spool, &sb) != -1) {
+        dry_run = true;
+        parse_crontab(USER_CRONTABS, user, user, false);
+        write_catchup_dropins();
+        index_reset();
+        dry_run = false;
+        if (errors) {
+            fprintf(stderr, "%s: %d errors, units left unchanged\n", user, errors);
+            free(spool);
+            return 1;
+        }
+    }
+
+    char **old_units = NULL;
+    char **old_signatures = NULL;
+    size_t old_count = 0;
+
+    DIR *dirp = opendir(arg_dest);
+    if (dirp) {
+        struct dirent *dent;
+        while ((dent = readdir(dirp))) {
+            char *unit = user_unit_name(dent->d_name, user);
+            if (!unit)
+                continue;
+            if (unit_in(unit, old_units, old_count)) {
+                free(unit);
+                continue;
+            }
+            if (old_count % 64 == 0) {
+                old_units = realloc(old_units, (old_count + 64) * sizeof(char *));
+                old_signatures = realloc(old_signatures, (old_count + 64) * sizeof(char *));
+            }
+            old_signatures[old_count] = unit_signature(unit);
+            old_units[old_count++] = unit;
+        }
+        closedir(dirp);
+    }
+
+    // drop-ins are only written when needed, don't leave stale ones around
+    for (size_t i = 0; i < old_count; i++)
+        remove_unit_files(old_units[i], false);
+
+    // no crontab anymore: all its units are removed below
+    if (!handed && stat(spool, &sb) != -1)
+        parse_crontab(USER_CRONTABS, user, user, false);
+    write_catchup_dropins();
+#ifdef ADAPTIVE
+    write_reclassified(spool);
+#endif
+    free(spool);
+
+    char **added = calloc(generated_count + 1, sizeof(char *));
+    char **changed = calloc(generated_count + 1, sizeof(char *));
+    char **removed = calloc(old_count + 1, sizeof(char *));
+    size_t n_added = 0, n_changed = 0, n_removed = 0;
+
+    for (size_t i = 0; i < generated_count; i++) {
+        size_t j;
+        for (j = 0; j < old_count; j++)
+            if (!strcmp(generated_units[i], old_units[j]))
+                break;
+        if (j == old_count)
+            added[n_added++] = generated_units[i];
+        else {
+            char *signature = unit_signature(generated_units[i]);
+            if (strcmp(signature, old_signatures[j]))
+                changed[n_changed++] = generated_units[i];
+            free(signature);
+        }
+    }
+    for (size_t j = 0; j < old_count; j++)
+        if (!unit_in(old_units[j], generated_units, generated_count)) {
+            remove_unit_files(old_units[j], true);
+            removed[n_removed++] = old_units[j];
+        }
+
+    // keep the schedule index, and so cron_runner, up to date
+    char *source;
+    asprintf(&source, "%s/%s", USER_CRONTABS, user);
+    index_load(SCHEDULE_INDEX, source);
+    write_schedule_index(SCHEDULE_INDEX);
+    free(source);
+
+    if (stat("/run/systemd/system", &sb) != -1) {
+        systemctl("stop", removed, n_removed);
+        if (n_changed) {
+            // the definition of an already loaded unit changed
+            systemctl("daemon-reload", NULL, 0);
+            systemctl("try-restart", changed, n_changed);
+        }
+        systemctl("start", added, n_added);
+        if (handed)
+            reload_user_manager(user);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%s: %zu added, %zu removed, %zu changed, applied in %.1f ms\n",
+           user, n_added, n_removed, n_changed,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+
+    for (size_t j = 0; j < old_count; j++) {
+        free(old_units[j]);
+        free(old_signatures[j]);
+    }
+    free(old_units);
+    free(old_signatures);
+    free(added);
+    free(changed);
+    free(removed);
+    return 0;
+}
+
+/*
+ * --all-users: cron-user-crontabs.service translates the whole spool
+ * in place and starts the new timers, without a daemon-reload.
+ */
+static int generate_users(void) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the system jobs, as indexed at boot
+    index_load(SCHEDULE_INDEX, USER_CRONTABS "/");
+    parse_dir(false, USER_CRONTABS);
+    write_catchup_dropins();
+#ifdef ADAPTIVE
+    write_reclassified(USER_CRONTABS "/");
+#endif
+
+    struct stat sb;
+    if (stat("/run/systemd/system", &sb) != -1)
+        for (size_t i = 0; i < generated_count; i += 1024)
+            systemctl("start", generated_units + i,
+                      generated_count - i < 1024 ? generated_count - i : 1024);
+    write_schedule_index(SCHEDULE_INDEX);
+
+    // from now on, the generator translates the spool inline again
+    close(open(reboot_file, O_CREAT, 0644));
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%zu user jobs started in %.1f ms\n", generated_count,
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+    return 0;
+}
+
+#ifdef USER_GENERATOR
+/* run by the user manager of a lingering user, for its own crontab only */
+static int generate_user_manager(void) {
+    struct passwd *pwd = getpwuid(getuid());
+    if (!pwd || !is_lingering(pwd->pw_name))
+        return 0;
+    char *user = strdup(pwd->pw_name);
+
+    user_manager = true;
+    char *runtime_reboot_file = NULL;
+    const char *runtime = getenv("XDG_RUNTIME_DIR");
+    if (runtime) {
+        asprintf(&runtime_reboot_file, "%s/crond.reboot", runtime);
+        reboot_file = runtime_reboot_file;
+    }
+
+    char *target;
+    asprintf(&target, "%s/cron.target", arg_dest);
+    FILE *f = fopen(target, "w");
+    if (!f) {
+        log_msg(3, "Couldn't create output, aborting: ", target);
         exit(1);
     }
+    fputs("[Unit]\n", f);
+    fputs("Description=systemd-cron\n", f);
+    fputs("Documentation=man:systemd.cron(7)\n", f);
+    fclose(f);
 
-    umask(0022);
+    char *dir;
+    asprintf(&dir, "%s/default.target.wants", arg_dest);
+    mkdir(dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    free(dir);
 
-    asprintf(&timers_dir, "%s/cron.target.wants", arg_dest);
-    mkdir(timers_dir, S_IRUSR | S_IWUSR | S_IXUSR);
+    char *link;
+    asprintf(&link, "%s/default.target.wants/cron.target", arg_dest);
+    symlink(target, link);
+    free(link);
+    free(target);
+
+    char *spool;
+    asprintf(&spool, "%s/%s", USER_MANAGER_CRONTABS, user);
+    if (access(spool, R_OK) == 0) {
+        parse_crontab(USER_MANAGER_CRONTABS, user, user, false);
+        write_catchup_dropins();
+        close(open(reboot_file, O_CREAT, 0644));
+    } else if (errno != ENOENT)
+        log_msg(3, "cannot read ", spool);
+    free(spool);
+
+    free(runtime_reboot_file);
+    free(user);
+    return 0;
+}
+#endif
 
+static int check_crontab(const char *path, const char *user) {
+    char *copy = strdup(path);
+    char *slash = strrchr(copy, '/');
+    const char *dirname = ".", *filename = copy;
+    if (slash == copy)
+        dirname = "/", filename = slash + 1;
+    else if (slash) {
+        slash[0] = '\0';
+        dirname = copy, filename = slash + 1;
+    }
+    parse_crontab(dirname, filename, user, false);
+    write_catchup_dropins();
+
+    // units were written to an output folder: their index goes along,
+    // the one of the running system is only changed by --apply
+    if (!dry_run) {
+        char *index;
+        asprintf(&index, "%s/schedule.idx", arg_dest);
+        write_schedule_index(index);
+        free(index);
+    }
+    free(copy);
+    return errors ? 1 : 0;
+}
+
+/* the system crontabs, that --root= can also generate ahead of time */
+void generate_system() {
     parse_crontab("/etc", "crontab", NULL, false);
     parse_crontab("/etc", "anacrontab", "root", true);
     parse_dir(true, "/etc/cron.d");
@@ -797,16 +2232,367 @@ int main(int argc, char *argv[]) {
     parse_parts_dir("weekly", 15);
     parse_parts_dir("monthly", 20);
     parse_parts_dir("yearly", 25);
+#ifdef RUNNER_THRESHOLD
+    generate_runner();
+#endif
+}
+
+static void fingerprint_file(MD5_CTX *context, const char *path) {
+    MD5Update(context, (unsigned char *)path, strlen(path) + 1);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    unsigned char buffer[65536];
+    ssize_t n;
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        MD5Update(context, buffer, n);
+    close(fd);
+    MD5Update(context, (unsigned char *)"", 1);
+}
+
+/* the names in a folder, with the content of the files when <contents> */
+static void fingerprint_dir(MD5_CTX *context, const char *dirname, bool contents, const char *suffix) {
+    struct dirent **entries;
+    int n = scandir(dirname, &entries, NULL, alphasort);
+    MD5Update(context, (unsigned char *)dirname, strlen(dirname) + 1);
+    if (n < 0)
+        return;
+    for (int i = 0; i < n; i++) {
+        const char *name = entries[i]->d_name;
+        size_t l = strlen(name);
+        if (name[0] != '.' &&
+            (!suffix || (l > strlen(suffix) && !strcmp(name + l - strlen(suffix), suffix)))) {
+            if (contents) {
+                char *path;
+                asprintf(&path, "%s/%s", dirname, name);
+                fingerprint_file(context, path);
+                free(path);
+            } else
+                MD5Update(context, (unsigned char *)name, l + 1);
+        }
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+static char *fingerprint() {
+    MD5_CTX context;
+    MD5Init(&context);
+    fingerprint_file(&context, GENERATOR_PATH);
+    fingerprint_file(&context, "/etc/passwd");
+    fingerprint_file(&context, "/etc/crontab");
+    fingerprint_file(&context, "/etc/anacrontab");
+    fingerprint_dir(&context, "/etc/cron.d", true, NULL);
+    fingerprint_dir(&context, "/etc/cron.hourly", false, NULL);
+    fingerprint_dir(&context, "/etc/cron.daily", false, NULL);
+    fingerprint_dir(&context, "/etc/cron.weekly", false, NULL);
+    fingerprint_dir(&context, "/etc/cron.monthly", false, NULL);
+    fingerprint_dir(&context, "/etc/cron.yearly", false, NULL);
+    // native timers mask cron jobs
+    fingerprint_dir(&context, "/usr/lib/systemd/system", false, ".timer");
+    fingerprint_dir(&context, "/etc/systemd/system", false, ".timer");
+
+    unsigned char digest[16];
+    MD5Final(digest, &context);
+    char *hex = malloc(33);
+    for (int i = 0; i < 16; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    return hex;
+}
+
+/* --root: generate the system units of an image in its PREBUILT_DIR */
+static int prebuild(const char *root) {
+    // the first build of an image: create the folder and its parents
+    char *folder = strdup(arg_dest);
+    for (char *p = strchr(folder + 1, '/'); p; p = strchr(p + 1, '/')) {
+        p[0] = '\0';
+        mkdir(folder, 0755);
+        p[0] = '/';
+    }
+    mkdir(folder, 0755);
+    free(folder);
+
+    struct dirent **entries;
+    int n = scandir(arg_dest, &entries, NULL, NULL);
+    for (int i = 0; i < n; i++)
+        free(entries[i]);
+    if (n > 0)
+        free(entries);
+    if (n != 2) {
+        fprintf(stderr, "%s%s must be an empty folder.\n", root, arg_dest);
+        return 1;
+    }
+    mkdir(timers_dir, S_IRUSR | S_IWUSR | S_IXUSR);
+
+    // @reboot jobs are kept, the fast path is only taken at boot
+    reboot_file = "/nonexistent";
+    generate_system();
+    write_catchup_dropins();
+#ifdef ADAPTIVE
+    // no report: an image seldom has a run history, ADAPTIVE=heavy still counts
+    if (reclassified_stream)
+        fclose(reclassified_stream);
+    free(reclassified);
+    reclassified = NULL;
+    reclassified_stream = NULL;
+    write_heavy_slice();
+#endif
+
+    char *path;
+    asprintf(&path, "%s/schedule.idx", arg_dest);
+    write_schedule_index(path);
+    free(path);
+
+    char *hex = fingerprint();
+    asprintf(&path, "%s/fingerprint", arg_dest);
+    FILE *f = fopen(path, "w");
+    if (!f || fprintf(f, "%s\n", hex) < 0 || fclose(f)) {
+        perror(path);
+        free(path);
+        free(hex);
+        return 1;
+    }
+    free(path);
+    free(hex);
+    return errors ? 1 : 0;
+}
+
+static bool copy_file(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    if (in < 0)
+        return false;
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out < 0) {
+        close(in);
+        return false;
+    }
+    ssize_t n;
+    // in kernel when possible, else the usual way
+    while ((n = copy_file_range(in, NULL, out, NULL, 1 << 20, 0)) > 0) {}
+    if (n < 0) {
+        char buffer[65536];
+        while ((n = read(in, buffer, sizeof(buffer))) > 0)
+            if (write(out, buffer, n) != n) {
+                n = -1;
+                break;
+            }
+    }
+    close(in);
+    return !close(out) && n == 0;
+}
+
+static bool install_dir(const char *from, const char *to, bool links) {
+    DIR *dirp = opendir(from);
+    if (!dirp)
+        return false;
+    bool ok = true;
+    struct dirent *dent;
+    while (ok && (dent = readdir(dirp))) {
+        const char *name = dent->d_name;
+        size_t l = strlen(name);
+        if (name[0] == '.' || !strcmp(name, "fingerprint") || !strcmp(name, "schedule.idx") ||
+            (l > 3 && !strcmp(name + l - 3, ".sh")))
+            continue;
+
+        char *source, *target;
+        struct stat sb;
+        asprintf(&source, "%s/%s", from, name);
+        asprintf(&target, "%s/%s", to, name);
+        if (links) {
+            // cron.target.wants: point to the copies
+            char *unit;
+            asprintf(&unit, "%s/%s", arg_dest, name);
+            ok = !symlink(unit, target) || errno == EEXIST;
+            free(unit);
+        } else if (!stat(source, &sb) && S_ISDIR(sb.st_mode)) {
+            ok = (!mkdir(target, 0755) || errno == EEXIST) &&
+                 install_dir(source, target, !strcmp(name, "cron.target.wants"));
+        } else
+            ok = copy_file(source, target);
+        free(source);
+        free(target);
+    }
+    closedir(dirp);
+    return ok;
+}
+
+/* the fast path at boot: the units built with the image are still right */
+static bool install_prebuilt() {
+    char *path;
+    asprintf(&path, "%s/fingerprint", PREBUILT_DIR);
+    char *expected = read_file(path);
+    free(path);
+    if (!expected)
+        return false;
+
+    char *hex = fingerprint();
+    bool match = strlen(expected) == 33 && !strncmp(expected, hex, 32);
+    free(expected);
+    free(hex);
+    if (!match) {
+        log_msg(5, "inputs changed since the image was built, ignoring ", PREBUILT_DIR);
+        return false;
+    }
+    if (!install_dir(PREBUILT_DIR, arg_dest, false)) {
+        log_msg(4, "cannot install ", PREBUILT_DIR);
+        return false;
+    }
+
+    // keep the prebuilt jobs in the schedule index
+    asprintf(&path, "%s/schedule.idx", PREBUILT_DIR);
+    index_load(path, NULL);
+    free(path);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        {"check", required_argument, NULL, 'c'},
+        {"user",  required_argument, NULL, 'u'},
+        {"apply", no_argument,       NULL, 'a'},
+        {"root",  required_argument, NULL, 'r'},
+        {"output", required_argument, NULL, 'o'},
+        {"all-users", no_argument,   NULL, 'A'},
+        {}
+    };
+    const char *check = NULL;
+    const char *user = NULL;
+    const char *root = NULL;
+    const char *output = PREBUILT_DIR;
+    bool apply = false;
+    bool all_users = false;
+    int c;
+
+    while ((c = getopt_long(argc, argv, "", options, NULL)) != -1) {
+        switch (c) {
+            case 'c':
+                check = optarg;
+                break;
+            case 'u':
+                user = optarg;
+                break;
+            case 'a':
+                apply = true;
+                break;
+            case 'r':
+                root = optarg;
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'A':
+                all_users = true;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [output_folder]\n"
+                                "       %s --check=<crontab> [--user=<user>] [output_folder]\n"
+                                "       %s --user=<user> --apply | output_folder\n"
+                                "       %s --all-users [output_folder]\n"
+                                "       %s --root=<image> [--output=<folder in image>]\n",
+                                argv[0], argv[0], argv[0], argv[0], argv[0]);
+                exit(1);
+        }
+    }
+
+    if (apply && !user) {
+        fprintf(stderr, "--apply requires --user\n");
+        exit(1);
+    }
+
+    if (root) {
+        if (chroot(root) || chdir("/")) {
+            perror(root);
+            exit(1);
+        }
+        arg_dest = output;
+        scripts_dir = PREBUILT_DIR;
+        debug = true;
+    } else if (optind < argc)
+        arg_dest = argv[optind];
+    else if (apply || all_users)
+        arg_dest = GENERATOR_DIR;
+    else if (check)
+        dry_run = true;
+    else
+        debug = true;
 
+    // interactive modes
+    if (check || user || all_users)
+        debug = true;
+
+    struct stat sb;
+    if (!dry_run && !root && stat(arg_dest, &sb) == -1) {
+        fprintf(stderr, "%s doesn't exist.\n", arg_dest);
+        exit(1);
+    }
+
+    umask(0022);
+
+    asprintf(&timers_dir, "%s/cron.target.wants", arg_dest);
+
+    if (root) {
+        int r = prebuild(root);
+        free(timers_dir);
+        return r;
+    }
+
+    if (!dry_run)
+        mkdir(timers_dir, S_IRUSR | S_IWUSR | S_IXUSR);
+
+#ifdef USER_GENERATOR
+    int r = generate_user_manager();
+    free(timers_dir);
+    return r;
+#endif
+
+    if (check) {
+        int r = check_crontab(check, user);
+        free(timers_dir);
+        return r;
+    }
+
+    if (all_users) {
+        int r = generate_users();
+        free(timers_dir);
+        return r;
+    }
+
+    if (user) {
+        int r = 0;
+        if (apply)
+            r = apply_user(user);
+        else {
+            parse_crontab(USER_CRONTABS, user, user, false);
+            write_catchup_dropins();
+        }
+        free(timers_dir);
+        return r;
+    }
+
+    // after boot, @reboot jobs must be left out
+    if (stat(reboot_file, &sb) != -1 || !install_prebuilt())
+        generate_system();
+
+#ifdef DEFER_USER_CRONTABS
+    if (stat(reboot_file, &sb) == -1)
+        defer_user_crontabs();
+    else
+#endif
     if (stat(USER_CRONTABS, &sb) != -1) {
         // /var is available
         parse_dir(false, USER_CRONTABS);
-        close(open(REBOOT_FILE, O_CREAT, 0644));
+        close(open(reboot_file, O_CREAT, 0644));
     } else {
         // schedule rerun
         workaround_var_not_mounted();
     }
 
+    write_catchup_dropins();
+    write_schedule_index(SCHEDULE_INDEX);
+#ifdef ADAPTIVE
+    write_reclassified(NULL);
+#endif
+
     free(timers_dir);
 
     return 0;
@@ -0,0 +1,26 @@
+# Sourced by the tests: the folder of the check builds and the helpers
+# printing "ok: <what>" or "FAIL: <what>: ..." then stopping the test.
+set -e
+
+check_dir=${CHECK_DIR:-/tmp/systemd-cron-check}
+user=$(id -un)
+
+# expect <what> <got> <expected>
+expect() {
+    if [ "$2" != "$3" ]; then
+        echo "FAIL: $1: got '$2', expected '$3'"
+        exit 1
+    fi
+    echo "ok: $1"
+}
+
+# fails <what> <command>...: the command must exit with an error
+fails() {
+    local what=$1
+    shift
+    if "$@" >/dev/null 2>&1; then
+        echo "FAIL: $what: succeeded"
+        exit 1
+    fi
+    echo "ok: $what"
+}